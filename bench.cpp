@@ -0,0 +1,148 @@
+// To compile: g++ -O2 bench.cpp -pthread
+// To run:     ./a.out [directory]
+// The directory (by default, the current directory) should be a large directory tree to
+// watch, but not so large as to exceed /proc/sys/fs/inotify/max_user_watches. A couple of
+// scratch files are made in it and removed.
+
+#include <chrono>
+#include <cstdarg>  // va_list, va_start(), va_end()
+#include <cstdio>  // vfprintf(), stderr
+#include <cstring>  // memcpy()
+#include <iostream>
+#include <string>  // string
+#include <thread>
+#include <vector>
+#include "inotify.hpp"
+extern "C" {
+#include <fcntl.h>  // open(), O_*
+#include <sys/stat.h>  // futimens()
+#include <unistd.h>  // close()
+}
+
+inline void log(const char* format...)
+{
+    va_list ap;  // arg startup
+    va_start(ap, format);
+    std::vfprintf(stderr, format, ap);
+    std::fputc('\n', stderr);  // append a newline character
+    va_end(ap);  // arg cleanup
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double seconds_since(Clock::time_point then)
+{
+    return std::chrono::duration<double>(Clock::now() - then).count();
+}
+
+// Time to set up a recursive watch on the directory with 1, 2, 4, ... threads.
+static void bench_setup(const std::string& dir)
+{
+    const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for ( unsigned threads = 1 ; ; threads = std::min(threads*2, max_threads) ) {
+	Inotify<void (*)(const char*...)> inotify { log };
+	inotify.parallel_setup(threads);
+	const auto then = Clock::now();
+	inotify.add_watch(dir);
+	std::cout << "setup with " << threads << " thread(s): "
+	    << seconds_since(then) << " s\n";
+	if ( threads == max_threads )
+	    break;
+    }
+}
+
+// Make IN_ATTRIB events in the directory by touching two files in turn, so that the 
+// kernel cannot merge them.
+static void make_events(const std::string& dir, int count)
+{
+    const int fds[2] = {
+	open((dir + "/bench.0").c_str(), O_WRONLY | O_CREAT, 0644),
+	open((dir + "/bench.1").c_str(), O_WRONLY | O_CREAT, 0644)
+    };
+    for ( int i = 0 ; i < count ; ++i )
+	futimens(fds[i % 2], nullptr);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Events per second read by read() and by read_batch().
+static void bench_read(const std::string& dir)
+{
+    const int rounds = 100;
+    const int count = 8000;  // events per round, within max_queued_events
+    Inotify<void (*)(const char*...)> inotify { log, IN_ATTRIB };
+    inotify.add_watch(dir + "/");
+    make_events(dir, 2);  // creates the files.
+    while ( inotify.read(100) ) {}
+
+    double elapsed = 0;
+    for ( int round = 0 ; round < rounds ; ++round ) {
+	make_events(dir, count);
+	const auto then = Clock::now();
+	while ( inotify.read(0) ) {}
+	elapsed += seconds_since(then);
+    }
+    std::cout << "read():       " << rounds*count / elapsed << " events/s\n";
+
+    std::vector<const inotify_event*> events;
+    elapsed = 0;
+    for ( int round = 0 ; round < rounds ; ++round ) {
+	make_events(dir, count);
+	const auto then = Clock::now();
+	while ( events.clear(), inotify.read_batch(events, SIZE_MAX, 0) ) {}
+	elapsed += seconds_since(then);
+    }
+    std::cout << "read_batch(): " << rounds*count / elapsed << " events/s\n";
+
+    unlink((dir + "/bench.0").c_str());
+    unlink((dir + "/bench.1").c_str());
+}
+
+// Events per second filtered by NameFilter, over a batch of events made up in memory as 
+// they would be read from kernel, half of them with names to reject.
+static void bench_filter()
+{
+    const int rounds = 1000;
+    const char* const names[] = { "report-2024.txt", ".report-2024.txt.swp", "index.html",
+	"main.cpp~", "data.bin", ".#notes.md", "Makefile", "upload.tmp" };
+    NameFilter filter;
+    for ( const char* pattern: { "*.swp", "*.swx", "*~", ".#*", "*.tmp", "4913", ".lock" } )
+	filter.add(pattern);
+
+    std::vector<char> batch;
+    int count = 0;
+    for ( ; batch.size() < 256 *1024 ; ++count ) {
+	const std::string name = names[count % 8];
+	const uint32_t len = (name.size()+sizeof(int))/sizeof(int)*sizeof(int);
+	inotify_event event = { 1, IN_CLOSE_WRITE, 0, len };
+	batch.resize(batch.size() + sizeof(event) + len, '\0');
+	char* const at = batch.data() + batch.size() - sizeof(event) - len;
+	std::memcpy(at, &event, sizeof(event));
+	std::memcpy(at + sizeof(event), name.data(), name.size());
+    }
+
+    std::vector<char> events(batch.size());
+    std::size_t rejected = 0;
+    double elapsed = 0;
+    for ( int round = 0 ; round < rounds ; ++round ) {
+	std::memcpy(events.data(), batch.data(), batch.size());  // with the masks back
+	const auto then = Clock::now();
+	rejected += filter.sweep(events.data(), events.size());
+	elapsed += seconds_since(then);
+    }
+    std::cout << "NameFilter:   " << double(rounds)*count / elapsed << " events/s, "
+	<< 100.0 * rejected / (double(rounds)*count) << "% rejected\n";
+}
+
+int main(int argc, char* argv[]) {
+    const std::string dir = argc > 1 ? argv[1] : ".";
+    try {
+	bench_setup(dir);
+	bench_read(dir);
+	bench_filter();
+    }
+
+    catch (std::system_error& error) {
+	std::cout << "Error: " << error.code() << " - " << error.what() << '\n';
+    }
+}
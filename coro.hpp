@@ -0,0 +1,223 @@
+// C++20 coroutine interface to Inotify, scheduled by Reactor
+//
+// How to use:
+//   Reactor reactor;
+//   Inotify<> inotify { log };
+//   Watcher<> watcher { reactor, inotify };
+//
+//   Task watch(Watcher<>& watcher) {
+//       while ( const inotify_event* event = co_await watcher.next() )
+//           ...
+//   }
+//
+//   watch(watcher);  // runs until the first co_await that has to wait.
+//   reactor.run();  // resumes the coroutines as their events are ready.
+//
+// Thousands of coroutines, each awaiting its own Watcher, can be served by a single
+// thread (or a small pool of threads) running the reactor. A coroutine suspended is
+// resumed in the thread that finds its inotify ready, its timeout expired, or it is
+// cancelled.
+
+
+
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#if __cpp_impl_coroutine  // compiled only under C++20 or later
+
+#include <chrono>  // milliseconds
+#include <coroutine>  // coroutine_handle<>, suspend_never
+#include <cstdint>  // uint64_t, SIZE_MAX
+#include <exception>  // terminate()
+#include <mutex>  // mutex, lock_guard<>
+#include <system_error>  // errno, system_error, system_category
+#include <utility>  // move()
+#include <vector>  // vector<>
+#include "inotify.hpp"  // Inotify<>
+#include "reactor.hpp"  // Reactor
+extern "C" {
+#include <sys/epoll.h>  // epoll_*(), EPOLL*
+#include <sys/eventfd.h>  // eventfd(), EFD_*
+#include <sys/timerfd.h>  // timerfd_create(), TFD_*
+#include <unistd.h>  // read(), write(), close()
+}
+
+struct Task {  // return type of a coroutine that starts at once and runs detached
+    struct promise_type {
+	Task get_return_object() noexcept { return {}; }
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+	void return_void() noexcept {}
+	void unhandled_exception() noexcept { std::terminate(); }
+	    // Nobody is there to catch it, so the coroutine should catch its own.
+    };
+};
+
+template <typename Log =Syslog<LOG_ERR>>
+class Watcher {
+// Awaitable events of an Inotify instance, for one coroutine at a time.
+    Reactor& reactor;
+    Inotify<Log>& inotify;
+    const int cancel_fd;  // eventfd signaled by cancel()
+    const int poll_fd;  // timerfd for the next_poll() of the inotify, if it polls any watch
+    const int epfd;  // epoll set of the inotify fds, cancel_fd and poll_fd, to register
+
+    struct Wait {  // state of a coroutine suspended
+	const std::chrono::milliseconds timeout;
+	const std::size_t max;  // 1 for next(), or the max for next_batch()
+	std::vector<const inotify_event*> events;  // the events ready
+	std::coroutine_handle<> handle;
+	int fd_id = -1, timer_id = -1;  // the sources registered in the reactor
+    };
+    template <bool Batch> class Awaiter;
+
+    std::mutex mutex;  // to guard the members below
+    Wait* waiting = nullptr;  // the coroutine suspended, if any
+    uint64_t generation = 0;
+	// number of waits so far, to tell a callback left over from an earlier wait, 
+	// which can find a later wait at the same address.
+
+    bool ready(Wait& wait) {
+	// Take the events ready, if any, or return true also if cancelled.
+	return inotify.try_read_batch(wait.events, wait.max) || cancelled();
+    }
+    bool cancelled() noexcept {
+	// Consume the cancel() request, if any.
+	uint64_t count;
+	return ::read(cancel_fd, &count, sizeof(count)) > 0;
+    }
+    void suspend(Wait& wait, std::coroutine_handle<> handle);
+    void resume(uint64_t generation, bool timed_out);
+
+public:
+    // Note, member functions that are not specified as noexcept may throw an
+    // system_error exception, which results from system call errors.
+
+    Watcher(Reactor& reactor, Inotify<Log>& inotify);
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+    ~Watcher();
+
+    Awaiter<false> next(std::chrono::milliseconds timeout =std::chrono::milliseconds(-1)) {
+	// co_await it for the next event, or nullptr if timed out or cancelled.
+	return { *this, timeout, 1 };
+    }
+    Awaiter<true> next_batch(std::size_t max =SIZE_MAX,
+	std::chrono::milliseconds timeout =std::chrono::milliseconds(-1)) {
+	// co_await it for a vector of up to max events ready at once, or an empty vector
+	// if timed out or cancelled. The events remain valid until the next co_await.
+	return { *this, timeout, max };
+    }
+
+    void cancel() noexcept {
+	// Resume the coroutine waiting with nothing, or if none, the next one to wait. It
+	// can be called from any other thread.
+	const uint64_t one = 1;
+	while ( ::write(cancel_fd, &one, sizeof(one)) == -1 && errno == EINTR ) {}
+    }
+};
+
+template <typename Log>
+template <bool Batch>
+class Watcher<Log>::Awaiter {
+    Watcher& watcher;
+    Wait wait;
+
+public:
+    Awaiter(Watcher& watcher, std::chrono::milliseconds timeout, std::size_t max):
+	watcher { watcher }, wait { timeout, max } {}
+
+    bool await_ready() { return watcher.ready(wait); }
+    void await_suspend(std::coroutine_handle<> handle) { watcher.suspend(wait, handle); }
+    auto await_resume() noexcept {
+	if constexpr ( Batch )
+	    return std::move(wait.events);
+	else
+	    return wait.events.empty() ? nullptr : wait.events.front();
+    }
+};
+
+template <typename Log>
+Watcher<Log>::Watcher(Reactor& reactor, Inotify<Log>& inotify):
+    reactor { reactor }, inotify { inotify },
+    cancel_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+    poll_fd { timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC) },
+    epfd { epoll_create1(EPOLL_CLOEXEC) }
+{
+    bool ok = cancel_fd != -1 && poll_fd != -1 && epfd != -1;
+    for ( const int fd:
+	{ inotify.native_handle(), inotify.wake_handle(), cancel_fd, poll_fd } ) {
+	epoll_event event {};
+	event.events = EPOLLIN;
+	ok = ok && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+    if ( !ok ) {
+	const int error = errno;
+	close(cancel_fd);
+	close(poll_fd);
+	close(epfd);
+	throw std::system_error(error, std::system_category());
+    }
+}
+
+template <typename Log>
+Watcher<Log>::~Watcher()
+// A coroutine still waiting will never be resumed.
+{
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	if ( waiting ) {
+	    reactor.remove(waiting->fd_id);
+	    reactor.remove(waiting->timer_id);
+	}
+    }
+    close(cancel_fd);
+    close(poll_fd);
+    close(epfd);
+}
+
+template <typename Log>
+void Watcher<Log>::suspend(Wait& wait, std::coroutine_handle<> handle)
+// Register the wait in the reactor, while holding the mutex so that the reactor will not 
+// resume it before we have done.
+{
+    std::lock_guard<std::mutex> lock { mutex };
+    wait.handle = handle;
+    waiting = &wait;
+    const uint64_t generation = ++this->generation;
+    Reactor::set_timer(poll_fd, inotify.next_poll());  // to poll while waiting
+    wait.fd_id = reactor.add_fd(epfd, EPOLLIN, [this, generation](uint32_t) {
+	resume(generation, false);
+    });
+    if ( wait.timeout.count() >= 0 )
+	wait.timer_id = reactor.add_timer(wait.timeout, {}, [this, generation] {
+	    resume(generation, true);
+	});
+}
+
+template <typename Log>
+void Watcher<Log>::resume(uint64_t generation, bool timed_out)
+// Resume the coroutine suspended from the reactor, if it is ready or timed out, once 
+// only, even if both come at once in two threads.
+{
+    Wait* wait;
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	if ( !waiting || generation != this->generation )
+	    return;  // resumed already
+	wait = waiting;
+	if ( !timed_out && !ready(*wait) ) {
+	    // not yet, such as when only commands were posted or polled nothing.
+	    Reactor::set_timer(poll_fd, inotify.next_poll());
+	    return;
+	}
+	waiting = nullptr;
+    }
+    reactor.remove(wait->fd_id);
+    reactor.remove(wait->timer_id);
+    wait->handle.resume();
+}
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* CORO_HPP */
@@ -0,0 +1,589 @@
+// Whole-filesystem watches by fanotify, with the interface of Inotify
+//
+// How to use:
+//   Fanotify<> fanotify { log };
+//   fanotify.add_watch("/data");  // no matter how large the tree is
+//   while ( const inotify_event* event = fanotify.read() )
+//       ...  // fanotify.path(event->wd), event->name, event->mask
+//
+// Inotify needs a watch on every directory, which takes kernel memory and a traversal of
+// the whole tree to set up. Instead, a fanotify mark on a filesystem (with
+// FAN_REPORT_DFID_NAME) reports every event in it with the file handle of its directory
+// and its name. So, a watch here costs O(1) to set up, and we resolve the handles to
+// pathnames on demand, with a cache, and report only the events below the watches.
+//
+// It needs CAP_SYS_ADMIN and Linux 5.9 or later. Without them, or for a filesystem that
+// cannot be marked (such as one without file handles), the watch falls back to an
+// Inotify of its own, so that the same code works either way. So does a watch on a
+// network filesystem, where fanotify would miss the changes by other hosts as inotify
+// would, which the Inotify polls instead.
+//
+// The events are translated into inotify_events, with the differences:
+// - A wd counts up from INT_MIN for a directory found by fanotify, which remains valid
+//   while the directory is in the cache, apart from the wds of the fallback watches,
+//   whether kernel or polled (-2, -3, ...) ones.
+// - The cookie is always 0, since fanotify does not pair IN_MOVED_FROM and IN_MOVED_TO.
+// - On IN_Q_OVERFLOW, there is nothing to recover, but events lost are lost.
+
+
+
+#ifndef FANOTIFY_HPP
+#define FANOTIFY_HPP
+
+#include <algorithm>  // max(), min(), none_of(), nth_element()
+#include <chrono>  // steady_clock, duration_cast<>
+#include <cstdint>  // uint32_t
+#include <cstring>  // strerror(), strlen(), memcpy()
+#include <memory>  // unique_ptr<>
+#include <stdexcept>  // out_of_range
+#include <string>  // string, to_string()
+#include <utility>  // pair<>
+#include <system_error>  // errno, system_error, system_category
+#include <unordered_map>  // unordered_map<>
+#include <vector>  // vector<>
+#include "inotify.hpp"  // Inotify<>, operator/()
+extern "C" {
+#include <fcntl.h>  // open(), open_by_handle_at(), name_to_handle_at(), file_handle
+#include <limits.h>  // PATH_MAX, INT_MIN
+#include <poll.h>  // pollfd, poll(), POLLIN
+#include <sys/eventfd.h>  // eventfd(), EFD_*
+#include <sys/fanotify.h>  // fanotify_*(), FAN_*, fanotify_event_metadata
+#include <sys/statfs.h>  // fstatfs()
+#include <unistd.h>  // read(), write(), readlink(), close()
+}
+
+// The fanotify masks are meant to match the inotify ones, which we rely on.
+static_assert(FAN_ACCESS == IN_ACCESS && FAN_MODIFY == IN_MODIFY &&
+    FAN_ATTRIB == IN_ATTRIB && FAN_CLOSE_WRITE == IN_CLOSE_WRITE &&
+    FAN_CLOSE_NOWRITE == IN_CLOSE_NOWRITE && FAN_OPEN == IN_OPEN &&
+    FAN_MOVED_FROM == IN_MOVED_FROM && FAN_MOVED_TO == IN_MOVED_TO &&
+    FAN_CREATE == IN_CREATE && FAN_DELETE == IN_DELETE &&
+    FAN_DELETE_SELF == IN_DELETE_SELF && FAN_MOVE_SELF == IN_MOVE_SELF &&
+    FAN_Q_OVERFLOW == IN_Q_OVERFLOW && FAN_ONDIR == IN_ISDIR,
+    "fanotify masks differ from inotify masks");
+
+template <typename Log =Syslog<LOG_ERR>>
+class Fanotify {
+    struct Root {  // watch given to add_watch()
+	std::string path;  // without trailing '/'
+	bool recursive;
+	int wd;
+	std::string fsid;
+    };
+    struct Dir {  // directory in the cache
+	std::string path;
+	std::string key;  // of the directory in wds
+	uint64_t seen;  // moves checked against path, to tell if it may have moved since
+	uint64_t used;  // fills when last resolved, to evict the least recently used
+    };
+    struct Filesystem {  // filesystem marked
+	int mount_fd;  // root opened, to resolve handles in the filesystem
+	unsigned roots;  // number of roots in it
+    };
+
+    const Log& log;
+    const uint32_t mask;
+    const std::size_t buffer_size, max_buffer_size;  // for the fallback
+    const int fan_fd;  // or -1 if fanotify is not available
+    const int wake_fd;  // eventfd signaled by cancel()
+
+    std::unique_ptr<Inotify<Log>> fallback;  // for the roots not marked by fanotify
+    std::vector<Root> roots;
+    std::unordered_map<std::string, Filesystem> filesystems;  // by fsid
+    std::unordered_map<std::string, int> wds;  // by fsid and file handle of a directory
+    std::unordered_map<int, Dir> dirs;  // by wd
+    std::size_t max_dirs = 64 *1024;  // most directories to keep in the cache
+    int last_wd = INT_MIN;
+    uint64_t fills = 0;  // number of fill()s, as the clock of the cache
+    std::vector<std::string> moves;  // directories moved or gone lately, in order
+    uint64_t forgotten = 0;  // moves before them, which no longer tell what they were
+    static constexpr std::size_t max_moves = 1024;  // to keep in moves
+    static bool own(int wd) noexcept { return wd < INT_MIN/2; }  // if not the fallback's
+
+    std::unique_ptr<char[]> buffer;  // to read fanotify events into
+    std::vector<char> events;  // the events translated into inotify_events
+    std::size_t next_event = 0;  // offset of the next event to return from events
+
+    uint32_t mark_mask() const noexcept {
+	// The directory events that we need to keep the cache right are always marked,
+	// but reported only if in mask.
+	return (mask & (IN_ALL_EVENTS & ~IN_ISDIR)) | FAN_MOVED_FROM | FAN_DELETE |
+	    FAN_MOVE_SELF | FAN_ONDIR;
+    }
+    static std::string fsid_of(int fd);
+    int resolve(const std::string& fsid, file_handle* handle, const std::string* path);
+    bool stale(const Dir& dir) const noexcept;
+    void invalidate(const std::string& path);
+    void forget() noexcept { forgotten += moves.size() + 1; moves.clear(); }
+	// Take every directory cached as stale, as if it had missed the moves.
+    void evict();
+    bool watched(const std::string& dir) const noexcept;
+    void translate(const char* record);
+    void push(int wd, uint32_t mask, const char* name);
+    bool fill();
+
+public:
+    // Note, member functions that are not specified as noexcept may throw an
+    // system_error exception, which results from system call errors.
+
+    Fanotify(const Log& log, uint32_t mask =IN_ALL_EVENTS,
+	std::size_t buffer_size =4 *1024, std::size_t max_buffer_size =0);
+	// The buffer sizes are for fanotify events as well as for the fallback Inotify.
+    Fanotify(const Fanotify&) = delete;
+    Fanotify& operator=(const Fanotify&) = delete;
+    ~Fanotify();
+
+    void cancel() noexcept {
+	// Wake up read() at once, which then returns as if timed out, as Inotify::cancel().
+	const uint64_t one = 1;
+	while ( ::write(wake_fd, &one, sizeof(one)) == -1 && errno == EINTR ) {}
+    }
+    bool native() const noexcept { return fan_fd != -1; }
+	// Tell if fanotify is available at all, though a root may still fall back.
+    void set_cache_size(std::size_t dirs) noexcept {
+	// Keep up to this many directories resolved, 64K by default, but for those of a 
+	// single batch of events, which are evicted only after the batch is read out.
+	max_dirs = std::max<std::size_t>(dirs, 1);
+    }
+
+    std::string path(int wd) const;
+    int add_watch(const std::string& path, bool in_move =true);
+	// in_move is passed to the fallback, and fanotify has no use for it.
+    void rm_watch(int wd) noexcept;
+
+    const inotify_event* read(int timeout =(-1));
+};
+
+template <typename Log>
+Fanotify<Log>::Fanotify(const Log& log, uint32_t mask,
+    std::size_t buffer_size, std::size_t max_buffer_size):
+    log { log }, mask { mask },
+    buffer_size { buffer_size }, max_buffer_size { max_buffer_size },
+#ifdef FAN_REPORT_DFID_NAME
+    fan_fd { fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC |
+	FAN_NONBLOCK, O_RDONLY | O_LARGEFILE) },
+#else
+    fan_fd { (errno = ENOSYS, -1) },
+#endif
+    wake_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+    buffer { new char[std::max(buffer_size, std::size_t(4 *1024))] }
+    // A fanotify event takes up to around 450 bytes, with its handle and name.
+{
+    if ( fan_fd == -1 )
+	log("Info: fanotify is not available (%s), so falls back to inotify",
+	    std::strerror(errno));
+    if ( wake_fd == -1 ) {
+	const int error = errno;
+	close(fan_fd);
+	throw std::system_error(error, std::system_category());
+    }
+}
+
+template <typename Log>
+Fanotify<Log>::~Fanotify()
+{
+    for ( auto& filesystem: filesystems )
+	close(filesystem.second.mount_fd);
+    close(fan_fd);
+    close(wake_fd);
+}
+
+template <typename Log>
+std::string Fanotify<Log>::fsid_of(int fd)
+// Return the fsid of the filesystem that the fd is in, as fanotify reports it, or an
+// empty string if failed.
+{
+    struct statfs st;
+    if ( fstatfs(fd, &st) == -1 )
+	return std::string();
+    return std::string((const char*)&st.f_fsid, sizeof(st.f_fsid));
+}
+
+template <typename Log>
+std::string Fanotify<Log>::path(int wd) const
+// Will throw an out_of_range exception if wd is not existing, as Inotify::path() does.
+{
+    if ( !own(wd) ) {
+	if ( !fallback )
+	    throw std::out_of_range("Fanotify::path()");
+	return fallback->path(wd);
+    }
+    return dirs.at(wd).path;
+}
+
+template <typename Log>
+int Fanotify<Log>::add_watch(const std::string& path, bool in_move)
+// Mark the filesystem of the path, unless marked already, and report the events below the
+// path, or only in it if the path ends with '/', as Inotify::add_watch() does.
+// Return the wd of the path, or -1 if failed with an error logged.
+{
+    if ( path.empty() ) {
+	log("Warning: Cannot watch \"\": %s", std::strerror(ENOENT));
+	return -1;
+    }
+
+    if ( fan_fd != -1 && !Inotify<Log>::blind(path) ) {
+	const bool recursive = path.back() != '/';
+	std::string name = path;
+	while ( name.size() > 1 && name.back() == '/' )
+	    name.pop_back();
+
+	const int dirfd = open(name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ( dirfd == -1 ) {
+	    log("Warning: Cannot watch \"%s\": %s", name.c_str(), std::strerror(errno));
+	    return -1;
+	}
+
+	union {
+	    file_handle handle;
+	    char bytes[sizeof(file_handle) + MAX_HANDLE_SZ];
+	} root;
+	root.handle.handle_bytes = MAX_HANDLE_SZ;
+	int mount_id;
+	const std::string fsid = fsid_of(dirfd);
+	const auto filesystem = filesystems.find(fsid);
+	if ( !fsid.empty() &&
+	    name_to_handle_at(dirfd, "", &root.handle, &mount_id, AT_EMPTY_PATH) == 0 &&
+	    (filesystem != filesystems.end() ||
+		fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mark_mask(),
+		    dirfd, nullptr) == 0) ) {
+	    if ( filesystem == filesystems.end() )
+		filesystems.emplace(fsid, Filesystem { dirfd, 1 });
+	    else {
+		close(dirfd);
+		++filesystem->second.roots;
+	    }
+	    const int wd = resolve(fsid, &root.handle, &name);
+	    roots.push_back(Root { name, recursive, wd, fsid });
+	    return wd;
+	}
+
+	log("Info: Cannot mark \"%s\" by fanotify (%s), so falls back to inotify",
+	    name.c_str(), std::strerror(errno));
+	close(dirfd);
+    }
+
+    if ( !fallback )
+	fallback.reset(new Inotify<Log>(log, mask, buffer_size, max_buffer_size));
+    return fallback->add_watch(path, in_move);
+}
+
+template <typename Log>
+void Fanotify<Log>::rm_watch(int wd) noexcept
+// Remove the watch that add_watch() has returned, with all below it.
+{
+    if ( !own(wd) ) {
+	if ( fallback )
+	    fallback->rm_watch(wd, true);
+	return;
+    }
+
+    for ( auto root = roots.begin() ; root != roots.end() ; ++root )
+	if ( root->wd == wd ) {
+	    const auto filesystem = filesystems.find(root->fsid);
+	    if ( --filesystem->second.roots == 0 ) {
+		fanotify_mark(fan_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, mark_mask(),
+		    filesystem->second.mount_fd, nullptr);
+		close(filesystem->second.mount_fd);
+		filesystems.erase(filesystem);
+	    }
+	    roots.erase(root);
+	    return;
+	}
+    log("Warning: Cannot remove watch %d: %s", wd, std::strerror(EINVAL));
+}
+
+template <typename Log>
+int Fanotify<Log>::resolve(const std::string& fsid, file_handle* handle,
+    const std::string* path)
+// Return the wd of the directory with the handle, looking up its pathname if not cached
+// or stale, or 0 if not found. The path, if given, is taken as its pathname.
+{
+    std::string key = fsid;
+    key.append((const char*)handle, sizeof(file_handle) + handle->handle_bytes);
+    const auto found = wds.find(key);
+    if ( found != wds.end() ) {
+	Dir& dir = dirs[found->second];
+	dir.used = fills;
+	if ( !stale(dir) ) {
+	    dir.seen = forgotten + moves.size();
+	    return found->second;
+	}
+    }
+
+    std::string resolved;
+    if ( path )
+	resolved = *path;
+    else {
+	const auto filesystem = filesystems.find(fsid);
+	const int fd = filesystem == filesystems.end() ? -1 :
+	    open_by_handle_at(filesystem->second.mount_fd, handle, O_PATH | O_CLOEXEC);
+	if ( fd != -1 ) {
+	    char link[PATH_MAX];
+	    const ssize_t size = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(),
+		link, sizeof(link));
+	    close(fd);
+	    static const std::string deleted = " (deleted)";
+	    if ( size > 0 && size < PATH_MAX ) {
+		resolved.assign(link, size);
+		if ( resolved.size() > deleted.size() && resolved.compare(
+		    resolved.size() - deleted.size(), deleted.size(), deleted) == 0 )
+		    resolved.clear();
+	    }
+	}
+    }
+
+    if ( found != wds.end() ) {  // stale
+	Dir& dir = dirs[found->second];
+	if ( !resolved.empty() )
+	    dir.path = std::move(resolved);
+	dir.seen = forgotten + moves.size();  // or, the last pathname known is the best.
+	return found->second;
+    }
+    if ( resolved.empty() )
+	return 0;
+
+    // The cache may grow over max_dirs here, since the wds may be in the events queued 
+    // already, until evict() at the next fill().
+    const int wd = last_wd++;
+    wds.emplace(key, wd);
+    dirs.emplace(wd,
+	Dir { std::move(resolved), std::move(key), forgotten + moves.size(), fills });
+    return wd;
+}
+
+template <typename Log>
+void Fanotify<Log>::evict()
+// Evict the least recently used directories but for the roots, down to 3/4 of max_dirs 
+// so as not to evict again soon. It is called only when no events are left to read, 
+// so none of their wds is evicted from under them.
+{
+    std::vector<std::pair<uint64_t, int>> lru;  // of the directories but the roots
+    lru.reserve(dirs.size());
+    for ( const auto& [wd, dir]: dirs )
+	if ( std::none_of(roots.begin(), roots.end(),
+	    [wd = wd](const Root& root) { return root.wd == wd; }) )
+	    lru.emplace_back(dir.used, wd);
+    const std::size_t count =
+	std::min(lru.size(), dirs.size() - std::min(dirs.size(), max_dirs - max_dirs/4));
+    std::nth_element(lru.begin(), lru.begin() + count, lru.end());
+    for ( std::size_t i = 0 ; i < count ; ++i ) {
+	const auto dir = dirs.find(lru[i].second);
+	wds.erase(dir->second.key);
+	dirs.erase(dir);
+    }
+}
+
+template <typename Log>
+void Fanotify<Log>::invalidate(const std::string& path)
+// Take the directories cached at or below the path as stale, since it has moved or gone.
+// Rather than looking for them through the whole cache at each move, the move is only
+// noted, and each directory checks the moves it has not seen when it is resolved next.
+{
+    if ( moves.size() == max_moves )
+	forget();  // Those that have not caught up with them are resolved afresh.
+    moves.push_back(path);
+}
+
+template <typename Log>
+bool Fanotify<Log>::stale(const Dir& dir) const noexcept
+// Tell if the directory may have moved since resolved, by the moves it has not seen.
+{
+    if ( dir.seen < forgotten )
+	return true;
+    for ( auto path = moves.begin() + (dir.seen - forgotten) ; path != moves.end() ;
+	++path )
+	if ( dir.path.compare(0, path->size(), *path) == 0 &&
+	    (dir.path.size() == path->size() || dir.path[path->size()] == '/') )
+	    return true;
+    return false;
+}
+
+template <typename Log>
+bool Fanotify<Log>::watched(const std::string& dir) const noexcept
+// Tell if the events in the directory (or of the directory itself) are to be reported.
+{
+    for ( const Root& root: roots ) {
+	if ( !root.recursive ) {
+	    if ( dir == root.path )
+		return true;
+	    continue;
+	}
+	const std::size_t size = root.path == "/" ? 0 : root.path.size();
+	if ( dir.compare(0, size, root.path, 0, size) == 0 &&
+	    (dir.size() == size || dir[size] == '/') )
+	    return true;
+    }
+    return false;
+}
+
+template <typename Log>
+void Fanotify<Log>::push(int wd, uint32_t mask, const char* name)
+// Append the event to events, with its name padded as kernel does for inotify.
+{
+    const std::size_t length = *name ? std::strlen(name) + 1 : 0;
+    const uint32_t len = (length + sizeof(inotify_event) - 1) /
+	sizeof(inotify_event) * sizeof(inotify_event);
+    const std::size_t offset = events.size();
+    events.resize(offset + sizeof(inotify_event) + len);
+    inotify_event* const event = (inotify_event*)&events[offset];
+    event->wd = wd;
+    event->mask = mask;
+    event->cookie = 0;
+    event->len = len;
+    std::memcpy(event->name, name, length);
+    std::memset(event->name + length, 0, len - length);
+}
+
+template <typename Log>
+void Fanotify<Log>::translate(const char* record)
+// Translate the fanotify event into inotify_events, if it is below any root.
+{
+    fanotify_event_metadata metadata;
+    std::memcpy(&metadata, record, sizeof(metadata));
+	// Kernel aligns the events only to 4 bytes, while the metadata has a 64-bit mask.
+    if ( metadata.fd >= 0 )
+	close(metadata.fd);  // not expected with FAN_REPORT_DFID_NAME.
+    if ( metadata.mask & FAN_Q_OVERFLOW ) {
+	forget();  // Directories may have moved unnoticed.
+	push(-1, IN_Q_OVERFLOW, "");
+	return;
+    }
+
+    // Find the directory and name of the event in its info records.
+    const char* info = record + metadata.metadata_len;
+    const char* const end = record + metadata.event_len;
+    for ( ; info < end ; info += ((const fanotify_event_info_header*)info)->len ) {
+	const auto& fid = *(const fanotify_event_info_fid*)info;
+	if ( fid.hdr.len == 0 )
+	    return;  // broken
+	if ( fid.hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+	    fid.hdr.info_type != FAN_EVENT_INFO_TYPE_DFID )
+	    continue;
+
+	file_handle* const handle = (file_handle*)fid.handle;
+	const char* name = fid.hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ?
+	    (const char*)handle->f_handle + handle->handle_bytes : "";
+	if ( name[0] == '.' && name[1] == '\0' )
+	    name = "";  // an event on the directory itself
+	const int wd = resolve(std::string((const char*)&fid.fsid, sizeof(fid.fsid)),
+	    handle, nullptr);
+	if ( wd == 0 )
+	    return;  // gone before we could tell where it was
+	const std::string& dir = dirs[wd].path;
+
+	if ( metadata.mask & FAN_ONDIR ) {
+	    if ( *name && metadata.mask & (FAN_MOVED_FROM | FAN_DELETE) )
+		invalidate(dir/name);
+	    else if ( !*name && metadata.mask & FAN_MOVE_SELF )
+		invalidate(dir);
+	}
+	if ( !watched(dir) )
+	    return;
+
+	// Fanotify merges the events on the same object while queued, which we split back
+	// in the order they must have happened, as inotify would report them.
+	static const uint32_t order[] = {
+	    IN_CREATE, IN_MOVED_TO, IN_OPEN, IN_ACCESS, IN_MODIFY, IN_ATTRIB,
+	    IN_CLOSE_NOWRITE, IN_CLOSE_WRITE, IN_MOVED_FROM, IN_DELETE,
+	    IN_MOVE_SELF, IN_DELETE_SELF
+	};
+	for ( const uint32_t bit: order )
+	    if ( metadata.mask & mask & bit )
+		push(wd, bit | (metadata.mask & IN_ISDIR), name);
+	return;
+    }
+}
+
+template <typename Log>
+bool Fanotify<Log>::fill()
+// Read the fanotify events pending into events, and return false if none were pending.
+{
+    const ssize_t size = ::read(fan_fd, buffer.get(), std::max(buffer_size,
+	std::size_t(4 *1024)));
+    if ( size == -1 ) {
+	if ( errno == EAGAIN )
+	    return false;
+	log("Error: read():%d - %s", errno, std::strerror(errno));
+	throw std::system_error(errno, std::system_category());
+    }
+
+    // The events of the last batch have all been read, so their wds can be evicted now.
+    if ( dirs.size() > max_dirs )
+	evict();
+    ++fills;
+    events.clear();
+    next_event = 0;
+    for ( const char* record = buffer.get() ; record < buffer.get() + size ; ) {
+	fanotify_event_metadata metadata;
+	std::memcpy(&metadata, record, FAN_EVENT_METADATA_LEN);
+	if ( metadata.event_len < FAN_EVENT_METADATA_LEN ||
+	    metadata.event_len > buffer.get() + size - record )
+	    break;  // broken
+	if ( metadata.vers == FANOTIFY_METADATA_VERSION )
+	    translate(record);
+	record += metadata.event_len;
+    }
+    return true;
+}
+
+template <typename Log>
+const inotify_event* Fanotify<Log>::read(int timeout)
+// Return the next event from fanotify or the fallback, or nullptr if timed out or
+// cancelled, as Inotify::read() does.
+{
+    const auto then = std::chrono::steady_clock::now();
+    for (;;) {
+	if ( next_event < events.size() ) {
+	    const inotify_event* const event = (const inotify_event*)&events[next_event];
+	    next_event += sizeof(inotify_event) + event->len;
+	    return event;
+	}
+	if ( fallback )
+	    if ( const inotify_event* const event = fallback->try_read() )
+		return event;
+
+	pollfd fds[4];
+	nfds_t count = 0;
+	fds[count++] = { wake_fd, POLLIN, 0 };
+	if ( fan_fd != -1 )
+	    fds[count++] = { fan_fd, POLLIN, 0 };
+	if ( fallback ) {
+	    fds[count++] = { fallback->native_handle(), POLLIN, 0 };
+	    fds[count++] = { fallback->wake_handle(), POLLIN, 0 };
+	}
+
+	int time_left = timeout;
+	if ( timeout > 0 )
+	    time_left = std::max<long>(0, timeout -
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+		    std::chrono::steady_clock::now() - then).count());
+	bool polling = false;  // if we wake up to poll the fallback before the timeout
+	if ( fallback )
+	    if ( const int due = fallback->next_poll() ;
+		due >= 0 && (time_left < 0 || due < time_left) ) {
+		time_left = due;
+		polling = true;
+	    }
+	switch ( poll(fds, count, time_left) ) {
+	    case 0:  // timed out, or time to poll!
+		if ( polling )
+		    continue;  // The fallback polls in try_read().
+		return nullptr;
+	    case -1:
+		if ( errno == EINTR )
+		    continue;
+		log("Error: poll():%d - %s", errno, std::strerror(errno));
+		throw std::system_error(errno, std::system_category());
+	}
+	if ( fds[0].revents & POLLIN ) {
+	    uint64_t signals;
+	    while ( ::read(wake_fd, &signals, sizeof(signals)) > 0 ) {}
+	    return nullptr;  // cancelled!
+	}
+	if ( fan_fd != -1 && fds[1].revents & POLLIN )
+	    fill();
+    }
+}
+
+#endif /* FANOTIFY_HPP */
@@ -35,28 +35,51 @@
 #ifndef INOTIFY_HPP
 #define INOTIFY_HPP
 
-#include <algorithm>  // mismatch()
-#include <chrono>  // system_clock::now(), duration_cast<>
-#include <cstring>  // strerror()
-#include <experimental/filesystem>
-    // path, path::filename(), directory_iterator(), is_directory(), is_other()
-    // Todo: "experimental/" and "-lstdc++fs" will be no longer needed since gcc 8.0; see 
-    // https://www.reddit.com/r/cpp/comments/7o9kg6.
-#include <string>  // basic_string<>, string
-#include <system_error>  // errno, system_error, system_category
-#include <unordered_map>  // unordered_map<>, .find(), .emplace(), .erase(), .at()
+#include <algorithm>  // max(), min(), sort(), reverse(), find(), any_of()
+#include <atomic>  // atomic<>
+#include <chrono>  // steady_clock::now(), duration_cast<>, ceil<>
+#include <condition_variable>  // condition_variable
+#include <cstdint>  // SIZE_MAX
+#include <cstdio>  // FILE, fopen(), fscanf(), fclose()
+#include <cstring>  // strerror(), strlen(), strnlen(), memcpy(), memset()
+#include <ctime>  // time_t, time()
+#include <deque>  // deque<>
+#include <exception>  // exception_ptr, current_exception(), rethrow_exception()
+#include <functional>  // function<>, greater<>, equal_to<>, hash<>
+#include <future>  // future<>, packaged_task<>
+#include <iterator>  // input_iterator_tag
+#include <memory>  // unique_ptr<>, make_shared<>
+#include <mutex>  // mutex, lock_guard<>
+#include <queue>  // priority_queue<>
+#include <stdexcept>  // out_of_range
+#include <string>  // basic_string<>, string, to_string()
+#include <string_view>  // string_view
+#include <system_error>  // errno, system_error, system_category, error_code
+#include <thread>  // thread, this_thread::get_id()
+#include <type_traits>  // invoke_result_t<>, is_invocable_v<>, true_type, false_type
+#include <unordered_map>  // unordered_map<>
+#include <unordered_set>  // unordered_set<>
+#include <utility>  // move(), exchange(), declval()
+#include <vector>  // vector<>
 #include "syslog.hpp"  // LOG_*, Syslog<>, log()
-#ifdef DEBUG
-#include <cstdio>  // printf()
-#endif
 extern "C" {
+#include <dirent.h>  // DT_*, IFTODT()
+#include <pthread.h>  // pthread_setaffinity_np(), cpu_set_t, CPU_*
+#include <fcntl.h>  // open(), openat(), O_*, AT_SYMLINK_NOFOLLOW
+#include <limits.h>  // NAME_MAX
 #include <poll.h>  // pollfd, POLLIN
+#include <sys/eventfd.h>  // eventfd(), EFD_*
 #include <sys/inotify.h>  // inotify_*(), IN_*, inotify_event
-#include <unistd.h>  // read(), close(), usleep()
+#include <sys/ioctl.h>  // ioctl(), FIONREAD
+#include <sys/resource.h>  // setpriority(), PRIO_PROCESS
+#include <sys/stat.h>  // stat, fstatat()
+#include <sys/statfs.h>  // statfs()
+#include <sys/syscall.h>  // SYS_getdents64
+#include <unistd.h>  // read(), write(), close(), syscall()
 }
-
-namespace fs = std::experimental::filesystem;
-    // Todo: "::experimental" will not be necessary since gcc 8.0.
+#if defined(__SSE2__)
+#include <immintrin.h>  // _mm_*(), _mm256_*()
+#endif
 
 
 
@@ -82,15 +105,283 @@ void printf(const char* format, Args... args) const {
 template <typename CharT, typename Traits, typename Alloc>
 inline std::basic_string<CharT, Traits, Alloc> operator/(
     const std::basic_string<CharT, Traits, Alloc>& path1, const CharT* path2)
-// Todo: Improve it.
-// inline std::string operator/(std::string&& path1, const std::string& path2)
+// If either path1 or path2 is empty, simply return the other side without '/' 
+// intervening in-between.
+{
+    if ( path1.empty() || *path2 == '\0' )
+	return path1.empty() ? path2 : path1;
+    std::basic_string<CharT, Traits, Alloc> path;
+    path.reserve(path1.size() + 1 + Traits::length(path2));
+    path = path1;
+    if ( path.back() != '/' )
+	path += '/';
+    return path += path2;
+}
+
+inline std::string fd_path(int dirfd)
+// Return the pathname prefix through which we can look up an entry in the directory 
+// opened as dirfd, as if using openat().
+// Note, we rely on /proc being mounted, as it is on any Linux system.
+{
+    return "/proc/self/fd/" + std::to_string(dirfd) + '/';
+}
+
+template <typename F>
+bool for_each_entry(int dirfd, F f)
+// Call f(name, type) for every entry in the directory opened as dirfd, except "." and 
+// "..", where type is one of DT_DIR, DT_REG, DT_LNK, etc, or f(name, type, inode) if f 
+// takes the inode number too.
+// We read the entries in large chunks using getdents64(), which also tells us the type 
+// of each entry on most filesystems (such as ext4, xfs, btrfs, and tmpfs), so we need to 
+// call fstatat() only for an entry of DT_UNKNOWN.
+// Return false with errno set if getdents64() fails.
+// Note, f should not call for_each_entry() again, since the buffer is shared.
+{
+    struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+    };
+    alignas(8) static thread_local char buffer[64 *1024];
+
+    for (;;) {
+	const long size = syscall(SYS_getdents64, dirfd, buffer, sizeof(buffer));
+	if ( size <= 0 )
+	    return size == 0;
+
+	for ( long offset = 0 ; offset < size ; ) {
+	    const linux_dirent64& entry = *(const linux_dirent64*)(buffer + offset);
+	    offset += entry.d_reclen;
+
+	    const char* const name = entry.d_name;
+	    if ( name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) )
+		continue;
+
+	    unsigned char type = entry.d_type;
+	    if ( type == DT_UNKNOWN ) {
+		struct stat st;
+		if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 )
+		    type = IFTODT(st.st_mode);
+	    }
+	    if constexpr ( std::is_invocable_v<F, const char*, unsigned char, ino_t> )
+		f(name, type, ino_t(entry.d_ino));
+	    else
+		f(name, type);
+	}
+    }
+}
+
+inline bool glob(const char* pattern, const char* text)
+// Tell if the text (a pathname) matches the pattern as in .gitignore, where '*' matches
+// any run of characters but '/', '?' any single character but '/', "[...]" any single
+// character in the set (or not in it if "[!...]"), and "**" any run of characters
+// including '/', so that "**/" also matches no directories at all. A '\' escapes the
+// character following it.
 {
-    return (fs::path(path1)/fs::path(path2)).string();
-    // Todo:
-    // If either path1 or path2 is empty, simple return the other side without '/' 
-    // intervening in-between.
+    for ( ; *pattern ; ++text ) {
+	switch ( *pattern ) {
+	    case '*': {
+		const bool any = pattern[1] == '*';  // if "**", which crosses '/' too
+		pattern += any ? 2 : 1;
+		if ( any && *pattern == '/' && glob(pattern + 1, text) )
+		    return true;
+		for ( ;; ++text ) {
+		    if ( glob(pattern, text) )
+			return true;
+		    if ( *text == '\0' || (!any && *text == '/') )
+			return false;
+		}
+	    }
+
+	    case '?':
+		if ( *text == '\0' || *text == '/' )
+		    return false;
+		++pattern;
+		break;
+
+	    case '[': {
+		if ( *text == '\0' || *text == '/' )
+		    return false;
+		const char* set = pattern + 1;
+		const bool negated = *set == '!' || *set == '^';
+		if ( negated )
+		    ++set;
+		bool found = false;
+		do {  // A ']' right after '[' is taken as itself.
+		    if ( set[1] == '-' && set[2] != '\0' && set[2] != ']' ) {
+			found |= set[0] <= *text && *text <= set[2];
+			set += 3;
+		    }
+		    else
+			found |= *set++ == *text;
+		} while ( *set != '\0' && *set != ']' );
+		if ( *set == '\0' ) {  // if not closed, '[' is taken as itself.
+		    if ( *text != '[' )
+			return false;
+		    ++pattern;
+		    break;
+		}
+		if ( found == negated )
+		    return false;
+		pattern = set + 1;
+		break;
+	    }
+
+	    case '\\':
+		if ( pattern[1] != '\0' )
+		    ++pattern;
+		// intentional fall-through
+	    default:
+		if ( *pattern != *text )
+		    return false;
+		++pattern;
+	}
+    }
+    return *text == '\0';
 }
 
+// Class for the set of filenames to reject, such as editor swap files, "*.tmp", "*~", and
+// lock files, by their prefixes, suffixes, or whole names.
+// Each pattern of up to 16 bytes is kept in a 16-byte block, left-aligned for a prefix or
+// a whole name (with its terminating '\0'), or right-aligned for a suffix. A name is
+// loaded into a block the same way, and compared with a pattern at once using SSE2, or
+// with two patterns at once using AVX2, where a bit mask tells which bytes to compare.
+// Longer patterns, and all of them without SSE2, are compared byte by byte.
+class NameFilter {
+    struct Set {  // patterns of up to 16 bytes
+	std::vector<unsigned char> blocks;  // 16 bytes for each pattern
+	std::vector<uint32_t> bits;  // of the bytes to compare in each block
+	std::size_t size() const noexcept { return bits.size(); }
+
+	void add(const char* pattern, std::size_t size, bool right) {
+	    const std::size_t at = blocks.size();
+	    blocks.resize(at + 16, 0);
+	    std::memcpy(&blocks[at + (right ? 16 - size : 0)], pattern, size);
+	    const uint32_t bits = (1u << size) - 1;
+	    this->bits.push_back(right ? bits << (16 - size) : bits);
+	}
+
+	bool match(const unsigned char* block) const noexcept {
+	    // Tell if any pattern matches the block of 16 bytes.
+	    std::size_t i = 0;
+#if defined(__AVX2__)
+	    const __m256i both = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128(reinterpret_cast<const __m128i*>(block)));
+	    for ( ; i + 2 <= size() ; i += 2 ) {
+		const uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(both,
+		    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&blocks[i * 16]))));
+		if ( (equal & bits[i]) == bits[i] ||
+		    (equal >> 16 & bits[i+1]) == bits[i+1] )
+		    return true;
+	    }
+#endif
+#if defined(__SSE2__)
+	    const __m128i name = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+	    for ( ; i < size() ; ++i ) {
+		const uint32_t equal = _mm_movemask_epi8(_mm_cmpeq_epi8(name,
+		    _mm_loadu_si128(reinterpret_cast<const __m128i*>(&blocks[i * 16]))));
+		if ( (equal & bits[i]) == bits[i] )
+		    return true;
+	    }
+#else
+	    for ( ; i < size() ; ++i ) {
+		uint32_t equal = 0;
+		for ( int k = 0 ; k < 16 ; ++k )
+		    equal |= uint32_t(block[k] == blocks[i * 16 + k]) << k;
+		if ( (equal & bits[i]) == bits[i] )
+		    return true;
+	    }
+#endif
+	    return false;
+	}
+    } heads, tails;  // prefixes and whole names, and suffixes
+    std::vector<std::string> long_prefixes, long_suffixes, long_names;
+
+public:
+    bool empty() const noexcept {
+	return !heads.size() && !tails.size() &&
+	    long_prefixes.empty() && long_suffixes.empty() && long_names.empty();
+    }
+
+    bool add(const std::string& pattern) {
+	// Add the pattern, which is "prefix*", "*suffix", or a whole name, or return false
+	// if it is none of them.
+	const std::size_t star = pattern.find('*');
+	if ( star == std::string::npos ) {
+	    if ( pattern.empty() )
+		return false;
+	    if ( pattern.size() < 16 )
+		heads.add(pattern.c_str(), pattern.size() + 1, false);  // with '\0'
+	    else
+		long_names.push_back(pattern);
+	}
+	else if ( star == 0 && pattern.find('*', 1) == std::string::npos ) {
+	    const std::string suffix = pattern.substr(1);
+	    if ( suffix.size() <= 16 )
+		tails.add(suffix.data(), suffix.size(), true);
+	    else
+		long_suffixes.push_back(suffix);
+	}
+	else if ( star == pattern.size() - 1 ) {
+	    const std::string prefix = pattern.substr(0, star);
+	    if ( prefix.size() <= 16 )
+		heads.add(prefix.data(), prefix.size(), false);
+	    else
+		long_prefixes.push_back(prefix);
+	}
+	else
+	    return false;
+	return true;
+    }
+
+    bool match(const char* name, std::size_t len) const noexcept {
+	// Tell if the name, of len bytes padded with '\0' as in inotify_event, is rejected.
+	const std::size_t size = strnlen(name, len);
+	if ( size == 0 )
+	    return false;
+	unsigned char block[16] = {};
+	if ( heads.size() ) {
+	    std::memcpy(block, name, std::min<std::size_t>(size + 1, 16));
+	    if ( heads.match(block) )
+		return true;
+	}
+	if ( tails.size() ) {
+	    const std::size_t n = std::min<std::size_t>(size, 16);
+	    std::memset(block, 0, 16 - n);
+	    std::memcpy(block + 16 - n, name + size - n, n);
+	    if ( tails.match(block) )
+		return true;
+	}
+
+	const std::string_view whole { name, size };
+	for ( const std::string& prefix: long_prefixes )
+	    if ( whole.substr(0, prefix.size()) == prefix )
+		return true;
+	for ( const std::string& suffix: long_suffixes )
+	    if ( size >= suffix.size() && whole.substr(size - suffix.size()) == suffix )
+		return true;
+	return std::find(long_names.begin(), long_names.end(), whole) != long_names.end();
+    }
+
+    std::size_t sweep(char* events, std::size_t size) const noexcept {
+	// Clear the mask of every event rejected by its name in the events of size bytes,
+	// as read from inotify, and return the number of them. The events of directories
+	// are never rejected, as we need them to keep the watches up to date.
+	std::size_t count = 0;
+	for ( std::size_t i = 0 ; i < size ; ) {
+	    inotify_event& event = *reinterpret_cast<inotify_event*>(events + i);
+	    i += sizeof(inotify_event) + event.len;
+	    if ( event.len && !(event.mask & IN_ISDIR) && match(event.name, event.len) ) {
+		event.mask = 0;
+		++count;
+	    }
+	}
+	return count;
+    }
+};
+
 // Class for an inotify instance that monitors (only) directories (possibly recursively)
 template <typename Log =Syslog<LOG_ERR>>
     // The parameter Log is type of a function (object), void (*)(const char*...), that 
@@ -99,280 +390,2567 @@ class Inotify {
     const Log& log;  // a function (object) for logging
 
     const int fd;  // inotify file descriptor associated with this inotify instance
-    pollfd fds;  // internal struct for calling poll()
-    uint32_t mask;  // the common mask to monitor all watches with
-	// Although the inotify_add_watch() can set a separate mask for each watch, we 
-	// provide here only a single global mask, because we are supporting only 
-	// directory watches and new directories can be created recursively and 
-	// implicitly, or existing watch directories can be moved into another watch. 
-	// Though such directories could inherit the masks of their parent directory 
-	// watches, it makes more sense to get them a default global mask.
-
-    struct Watch { std::string path; bool in_move; };
-    std::unordered_map<int, Watch> watches;  // dictionary that holds all watches
-
-    inotify_event buffer[(4 *1024+sizeof(inotify_event)-1) / sizeof(inotify_event)];
+    const int wake_fd;  // eventfd to wake up and cancel the wait in read()
+    const int command_fd;  // eventfd to wake up the wait in read() to run commands
+    pollfd fds[3];  // internal struct for calling poll() on fd, wake_fd, and command_fd
+
+    std::mutex commands_mutex;
+    std::vector<std::function<void()>> commands;  // posted by post() to run in read()
+    std::atomic<std::thread::id> reader {};  // thread that has called read() last
+    uint32_t mask;  // the common mask to monitor the watches with, unless told otherwise
+	// Each watch keeps a mask of its own (see Watch::mask), which is this one unless
+	// given to add_watch() or set_mask(). New directories that are created or moved
+	// into a watch inherit the mask of their parent watch.
+
+    class Watches {  // dense table that holds all watches, indexed by wd
+    public:
+	static constexpr uint32_t none = ~0u;
+
+	struct Watch {  // fixed-size record for each watch
+	    int wd;  // -1 if this slot is free, or -2, -3, ... if polled
+	    uint32_t parent;  // slot of the parent watch, or none for a root watch
+	    uint32_t first_child, prev_sibling, next_sibling;  // slots, or none
+	    uint32_t name;  // offset of the name in the name pool
+	    uint16_t name_size;
+	    bool recursive;
+	    bool in_move;
+	    float heat;  // events lately, decaying over time, to tell cold subtrees
+	    uint32_t mask;  // events of interest, to which watch_mask() adds our own
+	};
+	    // The name is the full pathname for a root watch (without trailing '/'), or 
+	    // the bare filename of the subdirectory for any other watch.
+
+	const Watch* find(int wd) const noexcept {
+	    const std::vector<uint32_t>& table = wd >= 0 ? index : pseudo_index;
+	    const std::size_t at = position(wd);
+	    const uint32_t slot = wd != -1 && at < table.size() ? table[at] : none;
+	    return slot == none ? nullptr : &slots[slot];
+	}
+	Watch* find(int wd) noexcept {
+	    return const_cast<Watch*>(static_cast<const Watches*>(this)->find(wd));
+	}
+	const Watch& at(int wd) const {
+	    if ( const Watch* watch = find(wd) )
+		return *watch;
+	    throw std::out_of_range("Inotify - unknown wd");
+	}
+	Watch& at(int wd) { return const_cast<Watch&>(static_cast<const Watches*>(this)->at(wd)); }
+
+	const Watch& operator[](uint32_t slot) const noexcept { return slots[slot]; }
+	Watch& operator[](uint32_t slot) noexcept { return slots[slot]; }
+	uint32_t slot(const Watch& watch) const noexcept { return &watch - slots.data(); }
+
+	std::string_view name(const Watch& watch) const noexcept {
+	    return { names.data() + watch.name, watch.name_size };
+	}
+
+	Watch& emplace(int wd, std::string_view name, bool recursive, uint32_t mask);
+	    // Note, any reference to a Watch will be invalidated by emplace().
+	void rekey(Watch& watch, int wd);  // changes its wd, such as to be polled
+	void rename(Watch& watch, std::string_view name);
+	void erase(Watch& watch) noexcept;
+
+	void link(Watch& watch, uint32_t parent) noexcept;
+	void unlink(Watch& watch) noexcept;
+
+	template <typename F>
+	void for_each(F f) const {  // calls f(watch) for every watch.
+	    for ( const Watch& watch: slots )
+		if ( watch.wd != -1 )
+		    f(watch);
+	}
+	template <typename F>
+	void for_each(F f) {
+	    for ( Watch& watch: slots )
+		if ( watch.wd != -1 )
+		    f(watch);
+	}
+	template <typename F>
+	void for_each_in_subtree(uint32_t slot, F f) const;
+
+	std::size_t count(bool polled) const noexcept { return counts[polled]; }
+	    // number of the kernel watches, or of the polled ones
+	std::size_t capacity() const noexcept { return slots.size(); }  // slots so far
+
+    private:
+	std::size_t counts[2] = { 0, 0 };
+	std::vector<uint32_t> index;  // slot for each wd, or none
+	std::vector<uint32_t> pseudo_index;  // slot for each pseudo wd of polled watches
+	static std::size_t position(int wd) noexcept {
+	    // Position of wd in index, or in pseudo_index if negative.
+	    return wd >= 0 ? wd : -(long(wd) + 2);
+	}
+	std::vector<Watch> slots;
+	uint32_t free_slot = none;  // head of the free list of slots, linked by next_sibling
+
+	std::vector<char> names;  // pool of names
+	std::vector<uint32_t> free_names;
+	    // heads of the free lists of names, one for each size class in units of 8 
+	    // bytes. Each free block keeps the offset of the next free block in it.
+
+	uint32_t alloc_name(std::string_view name);
+	void free_name(uint32_t offset, std::size_t size) noexcept;
+    } watches;
+	// The watches form a forest of trees, where every subdirectory watch of a 
+	// recursive watch is linked as a child of its parent watch. Each watch keeps only 
+	// its own name, so renaming (or moving) a watch is just to relink it under a new 
+	// parent, and the full pathname is built only when asked through path().
+	// Kernel allocates wds cyclically in increasing order, so the table indexes wds 
+	// with only 4 bytes each and keeps the records themselves densely in slots, 
+	// which are recycled through a free list.
+    using Watch = typename Watches::Watch;
+
+    std::unique_ptr<char[]> buffer;
 	// buffer to read in inotify events data from kernel.
-	// Its size is ~4K, but does not need more since inotify also has in-kernel 
-	// buffer, which has the size specified in /proc/sys/fs/inotify/max_queued_events.
+	// Its size is ~4K by default, which is usually enough since inotify also has 
+	// in-kernel buffer, which has the size specified in 
+	// /proc/sys/fs/inotify/max_queued_events. But, a larger buffer can drain a burst of 
+	// events with fewer read() system calls.
+	// The events made up by ourselves are queued separately in the created below.
+    std::size_t buffer_size;
+    const std::size_t min_buffer_size, max_buffer_size;
+	// The buffer_size adapts between these two, if they differ, to the number of bytes 
+	// pending in kernel.
     int bytes_in_buffer =0;
     int bytes_handled =0;
 
+    class Events {  // queue of synthetic events, kept apart from the buffer
+	// The events are stored in chunks allocated one at a time as the queue grows, so 
+	// that any number of events can be queued without a single large allocation, and 
+	// an event stays in place until reclaim() is called after it is popped.
+	static constexpr std::size_t chunk_size = 64 *1024;
+	struct Chunk { std::unique_ptr<char[]> data; std::size_t size; };
+	std::deque<Chunk> chunks;
+	std::size_t first = 0;  // index of the chunk holding the front event
+	std::size_t head = 0;  // offset of the front event in that chunk
+	std::unique_ptr<char[]> spare;  // chunk kept for reuse
+
+    public:
+	bool empty() const noexcept {
+	    return first == chunks.size() || (first+1 == chunks.size() && head == chunks[first].size);
+	}
+
+	inotify_event& push(uint32_t len) {
+	    // Append a new event with len bytes of name, to be filled by the caller.
+	    const std::size_t size = sizeof(inotify_event) + len;
+	    if ( chunks.empty() || chunks.back().size + size > chunk_size ) {
+		chunks.push_back(Chunk { spare ? std::move(spare) :
+		    std::unique_ptr<char[]>(new char[chunk_size]), 0 });
+	    }
+	    Chunk& chunk = chunks.back();
+	    inotify_event& event = *(inotify_event*)(chunk.data.get() + chunk.size);
+	    chunk.size += size;
+	    event.len = len;
+	    return event;
+	}
+
+	const inotify_event& pop() noexcept {
+	    // Pop the front event, which should exist.
+	    if ( head == chunks[first].size ) {
+		++first;
+		head = 0;
+	    }
+	    const inotify_event& event = *(inotify_event*)(chunks[first].data.get() + head);
+	    head += sizeof(inotify_event) + event.len;
+	    return event;
+	}
+
+	void reclaim() noexcept {
+	    // Free the chunks whose events have all been popped, so any event that has 
+	    // been popped should not be used after this.
+	    for ( ; first > 0 ; --first ) {
+		spare = std::move(chunks.front().data);
+		chunks.pop_front();
+	    }
+	    if ( empty() && !chunks.empty() ) {
+		spare = std::move(chunks.front().data);
+		chunks.clear();
+		head = 0;
+	    }
+	}
+    } created;  // synthetic IN_CREATE events prepared by add_watch()
+
+    unsigned setup_threads =1;  // number of threads to set up watches with
+
+    struct Excludes {  // exclude rules of a root watch, given by exclude()
+	std::vector<std::string> names;  // globs for the name of a directory at any level
+	std::vector<std::string> paths;  // globs for its pathname relative to the root
+	bool match(const std::string& path) const noexcept {
+	    // Tell if the directory of the pathname relative to the root is excluded.
+	    const char* const name = path.c_str() + (path.rfind('/') + 1);  // npos + 1 == 0
+	    return std::any_of(names.begin(), names.end(),
+		    [name](const std::string& glob) { return ::glob(glob.c_str(), name); }) ||
+		std::any_of(paths.begin(), paths.end(),
+		    [&path](const std::string& glob) { return ::glob(glob.c_str(), path.c_str()); });
+	}
+    };
+    std::unordered_map<std::string, Excludes> excludes;  // by the root pathname
+
+    struct Includes {  // include globs of a root watch, given by add_glob()
+	std::vector<std::string> globs;  // for the pathnames relative to the root
+	std::vector<std::vector<std::string>> dirs;
+	    // components of the directory part of each glob, that is, all but the last 
+	    // one, or all if the last one is "**"
+	enum Fit { none, leaf, inner };
+	    // for a directory that cannot contain a match, that can but none of its 
+	    // subdirectories can, and that can in its subdirectories too
+	Fit fit(const std::string& path) const {
+	    // Tell how the directory of the pathname relative to the root can contain a 
+	    // match, at best of all the globs.
+	    std::vector<std::string_view> names;
+	    for ( std::size_t at = 0 ; at < path.size() ; ) {
+		const std::size_t slash = std::min(path.find('/', at), path.size());
+		names.emplace_back(path.data() + at, slash - at);
+		at = slash + 1;
+	    }
+	    Fit best = none;
+	    for ( const auto& dir: dirs )
+		best = std::max(best, fit(dir, 0, names, 0));
+	    return best;
+	}
+	bool match(const std::string& path) const noexcept {
+	    return std::any_of(globs.begin(), globs.end(),
+		[&path](const std::string& glob) { return ::glob(glob.c_str(), path.c_str()); });
+	}
+    private:
+	static Fit fit(const std::vector<std::string>& dir, std::size_t i,
+	    const std::vector<std::string_view>& names, std::size_t j) {
+	    // Fit of the names from j on, against the components of dir from i on.
+	    if ( j == names.size() )
+		return i == dir.size() ? leaf : inner;
+	    if ( i == dir.size() )
+		return none;
+	    if ( dir[i] == "**" )  // for no directories, or for one more
+		return std::max(fit(dir, i+1, names, j), fit(dir, i, names, j+1));
+	    return ::glob(dir[i].c_str(), std::string(names[j]).c_str()) ?
+		fit(dir, i+1, names, j+1) : none;
+	}
+    };
+    std::unordered_map<std::string, Includes> includes;  // by the root pathname
+    mutable std::unordered_map<uint32_t, std::pair<std::string, const Includes*>> plans;
+	// include globs of the root watches, or nullptr if none, by slot, as looked up 
+	// by included() for the root pathname with them
+    NameFilter rejects;  // names of the files whose events are not reported
+    struct NameHash {  // transparent, to look up the names by string_view
+	using is_transparent = void;
+	std::size_t operator()(std::string_view name) const noexcept {
+	    return std::hash<std::string_view>()(name);
+	}
+    };
+    struct Files {  // files of a directory watched by add_file()
+	std::unordered_map<std::string, uint32_t, NameHash, std::equal_to<>> masks;
+	    // of each file, by its name
+	uint32_t mask;  // of all the files together
+	uint32_t own;  // of the directory itself, or 0 if watched only for the files
+    };
+    std::unordered_map<uint32_t, Files> files;  // by the slot of the directory watch
+#if !__cpp_lib_generic_unordered_lookup
+    std::string file_name;
+	// to look up an event name in, without allocating it every time, before C++20 
+	// lets us look it up by string_view.
+#endif
+
+    static constexpr std::size_t min_event_size = sizeof(inotify_event) + NAME_MAX + 1;
+	// The buffer should be able to hold at least one event of the longest name.
+    std::size_t delay_threshold;  // bytes pending in kernel to end the read_delay early
+    std::time_t drained_at;
+	// the last time when we found the kernel queue drained, up to which every event 
+	// has been read for sure. It tells which directories to rescan on IN_Q_OVERFLOW.
+
+    struct {
+	int max_delay =0;  // ceiling of the delay in milliseconds, or 0 if not adaptive
+	double busy_rate =1000;  // events per second from which the delay is raised
+	double rate =0;  // moving average of events per second seen at reads over time
+	std::chrono::steady_clock::time_point last_read;
+    } adaptive;  // state of the adaptive read_delay
+
+    struct Entry {  // entry of a polled directory, as seen last
+	std::string name;
+	ino_t ino;
+	unsigned char type;  // DT_DIR, DT_REG, or DT_LNK
+	timespec mtime, ctime;  // only if mask has IN_MODIFY or IN_ATTRIB
+    };
+    struct Poll {  // state of a polled directory
+	timespec mtime;  // of the directory, as seen last
+	std::vector<Entry> entries;  // sorted by name
+	int interval;  // milliseconds to wait before polling again
+	std::chrono::steady_clock::time_point due;
+	bool demoted;  // if polled for the lack of kernel watches, to be promoted back
+    };
+    std::unordered_map<int, Poll> polls;  // by wd of the polled watches
+    int last_pseudo_wd = -1;
+
+    using Due = std::pair<std::chrono::steady_clock::time_point, int>;  // with wd
+    struct {
+	int min_interval =1000, max_interval =30000;  // in milliseconds
+	double budget =1000;  // system calls per second to spend on polling
+	double tokens =1000;  // of the budget left, each for a system call
+	std::chrono::steady_clock::time_point refilled;
+	std::priority_queue<Due, std::vector<Due>, std::greater<Due>> schedule;
+	    // the polls by due time, earliest first, where an item is stale if its due 
+	    // does not match the due of its poll.
+	std::vector<std::pair<std::string, bool>> mounts;  // set by poll_mount()
+	uint32_t cookie =0;  // of the last IN_MOVED_FROM and IN_MOVED_TO paired
+    } poller;  // state of polling for the filesystems inotify is blind to
+
+    struct {
+	std::size_t limit =0;  // kernel watches we may use, or 0 if not managed
+	double high =0.9, low =0.8;  // of limit, to demote at and down to
+	float hot =8;  // heat of a subtree demoted, from which it is promoted
+	std::chrono::steady_clock::time_point decayed;  // when the heat was halved last
+	std::chrono::steady_clock::time_point checked;  // when rebudget() ran last
+	bool demoting =false;  // if demoting down to low, over the calls to rebudget()
+	std::vector<int> promote;  // demoted subtrees turned hot, by wd of the top
+	std::unordered_map<int, int> aliases;
+	    // pseudo wds of the watches demoted, by their kernel wds, for the events 
+	    // still coming from kernel until IN_IGNORED
+    } budget;  // state of the watch budget
+
+    struct Pending {  // root watch waiting for its directory to come
+	std::string path;  // as the root is named, without trailing '/'
+	bool recursive;
+	bool in_move;
+	uint32_t mask;
+	int wd;  // kernel watch on the deepest ancestor existing, where it waits
+	std::size_t end;  // of that ancestor in path
+	bool own =true;  // if it reports its own events, unless added only by add_file()
+	std::vector<std::pair<std::string, uint32_t>> files;
+	    // added by add_file() meanwhile, with their masks
+    };
+    std::vector<Pending> pending;
+    bool pend_roots =false;  // set by pend_missing()
+    static constexpr uint32_t pending_mask =
+	IN_ONLYDIR | IN_CREATE | IN_MOVED_TO | IN_MOVE_SELF | IN_MASK_ADD;
+	// The ancestors are watched only for the next component of the path to come, or 
+	// for themselves to go. IN_MASK_ADD keeps the mask of an ancestor that is also a 
+	// watch of ours.
+
 public:
     // Note, member functions that are not specified as noexcept may throw an 
     // system_error exception, which results from system call errors.
 
-    Inotify(const Log& log, uint32_t mask =IN_ALL_EVENTS):
-	log { log }, fd { inotify_init1(IN_NONBLOCK) }, fds { fd, POLLIN }, mask { mask }
+    struct Stats {
+	uint64_t reads =0;  // number of read() system calls on fd
+	uint64_t bytes_read =0;  // total bytes of events read by them
+	uint64_t events_read =0;  // total number of events read by them
+	uint64_t overflows =0;  // number of IN_Q_OVERFLOWs recovered from
+	std::size_t ring_high_water =0;  // most events ever held in the ring by drain()
+	int delay =0;  // read_delay chosen last by adaptive_delay(), in milliseconds
+	uint64_t polls =0;  // number of times the polled directories are scanned
+	std::size_t watches =0;  // kernel watches in use
+	std::size_t polled =0;  // directories polled, by filesystem or by budget
+	std::size_t watch_limit =0;  // kernel watches we may use (see set_watch_budget())
+	uint64_t evictions =0;  // kernel watches demoted to polling
+	uint64_t promotions =0;  // polled watches promoted back to kernel
+	uint64_t unwatched =0;  // directories failed to watch and to poll, left blind
+	std::size_t pending =0;  // root watches waiting for their directories to come
+	uint64_t excluded =0;  // directories left unwatched by the exclude rules
+	uint64_t rejected =0;  // events dropped by their names (see reject_name())
+
+	double bytes_per_read() const noexcept {
+	    return reads ? double(bytes_read) / reads : 0;
+	}
+	double events_per_read() const noexcept {
+	    // How many events each wakeup coalesces, which rises with the delay.
+	    return reads ? double(events_read) / reads : 0;
+	}
+    };
+
+    Inotify(const Log& log, uint32_t mask =IN_ALL_EVENTS,
+	std::size_t buffer_size =4 *1024, std::size_t max_buffer_size =0):
+	// The buffer to read events from kernel has buffer_size bytes. If max_buffer_size 
+	// is larger than that, the buffer grows up to max_buffer_size bytes so that all 
+	// the events pending in kernel can be read with a single read(), and shrinks back 
+	// as the events calm down.
+	log { log }, fd { inotify_init1(IN_NONBLOCK) },
+	wake_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+	command_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+	fds { { fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 }, { command_fd, POLLIN, 0 } },
+	mask { mask },
+	buffer_size { std::max(buffer_size, min_event_size) },
+	min_buffer_size { this->buffer_size },
+	max_buffer_size { std::max(max_buffer_size, this->buffer_size) }
     {
-	if ( fd == -1 )
-	    throw std::system_error(errno, std::system_category());
+	if ( fd == -1 || wake_fd == -1 || command_fd == -1 ) {
+	    const int error = errno;
+	    close(fd);
+	    close(wake_fd);
+	    close(command_fd);
+	    throw std::system_error(error, std::system_category());
+	}
+	buffer.reset(new char[this->buffer_size]);
+	drained_at = std::time(nullptr);
+
+	// By default, the read_delay ends early when the bytes pending in kernel reach 3/4 
+	// of what max_queued_events events would take at least.
+	delay_threshold = sysctl("max_queued_events", 16384) * sizeof(inotify_event) * 3/4;
+	budget.decayed = budget.checked = std::chrono::steady_clock::now();
     }
 
-    ~Inotify() { close(fd); }
+    ~Inotify() { stop_drain(); close(fd); close(wake_fd); close(command_fd); }
 
-    const std::string& path(int wd) const {
-	// will throw an out_of_range exception if wd is not existing.
-	return watches.at(wd).path;
+    void cancel() noexcept {
+	// Wake up read() (or any other call waiting for events) at once, which then 
+	// returns as if timed out. It can be called from any other thread or a signal 
+	// handler, and if no one is waiting, the next wait will return at once.
+	// This is also the way to shut down a thread looping on read() cleanly.
+	signal(wake_fd);
     }
 
-    int add_watch(const std::string&, bool =true);
-    void rm_watch(int wd) noexcept;
-    void rm_all_watches() noexcept;
+    template <typename F>
+    auto post(F f) -> std::future<std::invoke_result_t<F, Inotify&>>;
 
-    const inotify_event* read(int timeout =(-1), int read_delay =0);
-};
+    void set_delay_threshold(std::size_t bytes) noexcept { delay_threshold = bytes; }
+	// The read_delay ends early once this many bytes of events are pending in kernel.
 
-template <typename Log>
-int Inotify<Log>::add_watch(const std::string& path, bool in_move)
-// The given path is required to be non-empty string for an existing directory. 
-// Otherwise, it will be ignored, but with an error logged.
-// If the path already contains child files and subdirectories in it, the in_move flag 
-// comes in play. If true and if the path is recursive (that is, not ending with '/'), 
-// every subdirectory (but not file) will have its own watch set up recursively and 
-// implicitly without notifying. If false, regardless of whether the path is recursive or 
-// not, every (immediate) child file and subdirectory will be prepared to be reported as 
-// IN_CREATE by the next call to read() (but, in this case, read() may duplicately report 
-// the same IN_CREATE event for some files or directories, depending on how fast the path 
-// watch kicks in).
-// Note that the in_move flag is not just for IN_MOVED_TO'd watches, but also can be used 
-// for initial setup of watches on existing directories, which is why its default 
-// argument is set true.
-// Todo: watch for non-existing directory/file yet.
-// Todo: negative watch specification.
-{
-    const bool recursive = path.back() != '/';
-	// will be always true if called from read().
-    const int wd = inotify_add_watch(fd, path.c_str(),
-	mask | IN_ONLYDIR | IN_MOVE_SELF | (recursive ? IN_CREATE | IN_MOVED_TO : 0));
-	// IN_ONLYDIR is to set up a watch on directory only.
+    void adaptive_delay(int max_delay, double busy_rate =1000) noexcept {
+	// Let read() choose the read_delay by itself, instead of the one given by the 
+	// caller, in [0..max_delay] milliseconds, or stop it if max_delay is 0. The delay 
+	// stays 0 while events come in slower than busy_rate per second, and doubles at 
+	// each read under a faster rate toward max_delay, and halves back as it calms down.
+	adaptive.max_delay = std::max(0, max_delay);
+	adaptive.busy_rate = busy_rate;
+	adaptive.rate = 0;
+	statistics.delay = 0;
+    }
 
-    if ( wd == -1 ) {  // if non-directory, non-existing, or without read-permission,
-	//log("Warning: Cannot watch \"%s\": %m", path.c_str());
-	    // We can use "%m" for strerror(errno) if log is Syslog<> function object.
-	log("Warning: Cannot watch \"%s\": %s", path.c_str(), std::strerror(errno));
-	return wd;
+    std::string path(int wd) const;
+    Stats stats() const noexcept {
+	// While draining, to be called through post(), or after stop_drain() (see drain()).
+	Stats stats = statistics;
+	stats.watches = watches.count(false);
+	stats.polled = watches.count(true);
+	stats.watch_limit = budget.limit;
+	stats.pending = pending.size();
+	stats.ring_high_water = ring_high_water();
+	return stats;
+    }
+    std::size_t ring_high_water() const noexcept {
+	// Most events ever held in the ring by drain(), which can be read live by the 
+	// thread calling drain() and receive() to see the back pressure on the ring.
+	return ring ? std::max(statistics.ring_high_water, ring->high_water.load())
+	    : statistics.ring_high_water;
     }
 
-    const auto it = watches.find(wd);
-    if ( it == watches.end() ) {
-	printf("[%d] %s created\n", wd, path.c_str());
-	watches.emplace(wd, Watch { path, false });
+    void parallel_setup(unsigned threads) noexcept {
+	// Use the given number of threads, or as many as the hardware threads if 0, to 
+	// traverse subdirectories when a recursive watch is added with in_move set.
+	setup_threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
     }
 
-    else {  // if the watch was already registered,
-	// The above inotify_add_watch() will return wd of an existing watch if there 
-	// already exists a watch for the given path, in which case we determine the 
-	// watch is moved rather than created newly.
+    void set_polling(int min_interval, int max_interval =30000, double budget =1000) noexcept {
+	// Poll each directory of a polled watch every min_interval milliseconds while it 
+	// keeps changing, backing off up to every max_interval while it does not, but 
+	// with no more than budget system calls per second over all of them, which are 
+	// 1000, 30000, and 1000 by default.
+	poller.min_interval = std::max(1, min_interval);
+	poller.max_interval = std::max(poller.min_interval, max_interval);
+	poller.budget = poller.tokens = std::max(1.0, budget);
+    }
+    void poll_mount(const std::string& path, bool polled =true);
+    bool polled(const std::string& path) const;
+    static bool blind(const std::string& path) noexcept;
+    int next_poll() noexcept;
 
-	const std::string& path0 = it->second.path;
-	const auto& diff = std::mismatch(path0.begin(), path0.end(), path.begin());
-	    // finds the first mismatched characters in comparing path0 and path.
-	if ( diff.first == path0.end() &&
-	    (diff.second == path.end() || !recursive && diff.second+1 == path.end()) ) {
-	    // Do nothing if path == path0 or path == path0 + "/".
-	    printf("[%d] %s ignored as a duplicate\n", wd, path.c_str());
-	    return wd;
-	}
-	printf("[%d] %s %s\n", wd, path.c_str(),
-	    //in_move ? "moved" : "changed to recursive");
-		// commented-out because in_move can be true for initial setup of watches 
-		// on existing directories.
-	    diff.second == path.end() && diff.first+1 == path0.end() &&
-		*diff.first == '/' ? "changed to recursive" : "moved");
-	it->second.path = path;
-	//it->second.in_move = false;  // not necessary
+    void set_watch_budget(std::size_t limit, double high =0.9, double low =0.8,
+	float hot =8) noexcept {
+	// Use up to limit kernel watches, or any if 0 as by default. Once high of it is 
+	// in use, the coldest subtrees are demoted to polling down to low of it. A 
+	// subtree demoted is promoted back once it gets hot, that is, has about hot 
+	// events within a minute, if it fits in the limit, and then colder ones are 
+	// demoted in turn if high is passed.
+	// The max_user_watches is shared by all the inotify instances of the user, so the 
+	// limit should be the share of this instance, such as what is free of it now. 
+	// Without a limit, a directory that finds kernel out of watches (ENOSPC) is polled 
+	// anyway, and the limit is set to the watches we have got then.
+	budget.limit = limit;
+	budget.high = std::min(1.0, high);
+	budget.low = std::min(low, budget.high);
+	budget.hot = hot;
+	budget.demoting = false;
     }
 
-    // Note, when a directory that is either already a watch or not is moved into another 
-    // watch, its children come into existence at the same time of its move and we will 
-    // never get a report from it for the existence of any its children although its 
-    // watch (if it is a watch) kicks in immediately on its move, and even if it has any 
-    // subdirectories that are also a watch we will not get any report for its 
-    // grand-children since they are also moved at the same time as it is moved. If it is 
-    // not a watch, we can only set up its watch, no matter how fast we do, after all its 
-    // children have been moved. So, we will get notified of only the top directory in 
-    // this case.
+    void pend_missing(bool on =true) noexcept {
+	// Let add_watch() keep a root watch on a directory not existing yet pending, rather 
+	// than ignore it, until the directory comes (see pend()).
+	pend_roots = on;
+    }
 
-    // When a non-empty directory is copied into a watch together with its children, 
-    // however, we may get notified of the existence of any its children, depending on 
-    // how fast we set up its watch. If some children are already copied before we set up 
-    // the watch, we will miss reports for those children. If it has any grand-children, 
-    // we will get their reports only after we set up a watch for their corresponding 
-    // parent and only for such grand-children that are copied after their parent watch 
-    // kicks in. This is because the inotify watches are basically non-recursive and 
-    // effective only for their immediate children. So, in this case, we may get reports 
-    // for some children and may miss for other children.
+    void exclude(const std::string& root, const std::string& pattern);
+    void reject_name(const std::string& pattern) {
+	// Drop the events for the files (but not directories) of the names matching the 
+	// pattern, which is "prefix*", "*suffix", or a whole name, like ".#*", "*.swp", 
+	// "*~", or "4913", as soon as they are read from kernel (see NameFilter).
+	if ( !rejects.add(pattern) )
+	    log("Warning: Cannot reject \"%s\": not a prefix, suffix, or name", pattern.c_str());
+    }
+    int add_watch(const std::string&, bool =true, uint32_t =0);
+    int add_glob(const std::string& pattern, bool in_move =true, uint32_t mask =0);
+    int add_file(const std::string& path, uint32_t mask =0);
+    void rm_file(const std::string& path);
+    void rm_watch(int wd, bool subtree =false) noexcept;
+    bool rm_pending(const std::string& path) noexcept;
+    void set_mask(int wd, uint32_t mask, bool subtree =true);
+    void rm_all_watches() noexcept;
 
-    // In case we are IN_MOVED_To'd, we traverse all the subdirectories (but not files) 
-    // and set up their watches recursively and implicitly, without reporting to the 
-    // read().
-    if ( in_move ) {  // if we are IN_MOVED_TO'd,
-	if ( recursive )
-	    // We create a watch for every subdirectory down below, but without reporting 
-	    // it to read().
-	    for ( const fs::path& subdir: fs::directory_iterator(path) )
-		// The directory_iterator() here will always succeed, since the previous 
-		// check for "wd == -1" filters out what is not this case.
-		if ( fs::is_directory(subdir) /* && !fs::is_symlink(subdir) */ )
-		    // The is_directory() and the is_symlink() are mutually exclusive.
-		    add_watch(subdir.string(), true);
+    const inotify_event* read(int timeout =(-1), int read_delay =0);
+    template <typename Container>
+    std::size_t read_batch(Container& events, std::size_t max =SIZE_MAX,
+	int timeout =(-1), int read_delay =0);
+
+    class Batch;
+    Batch events(int timeout =(-1), int read_delay =0);
+
+    int native_handle() const noexcept { return fd; }  // inotify fd to poll for events
+    int wake_handle() const noexcept { return command_fd; }  // eventfd to poll for post()
+    const inotify_event* try_read();
+    template <typename Container>
+    std::size_t try_read_batch(Container& events, std::size_t max =SIZE_MAX);
+
+    struct Event {  // event resolved by the drain thread, or by read_batch() on request
+	int wd;
+	uint32_t mask;
+	uint32_t cookie;
+	std::string path;  // full pathname of the directory, or of its entry if named
+    };
+
+    void drain(std::size_t capacity =4096, int read_delay =0, int cpu =(-1), int nice =0);
+    void stop_drain() noexcept;
+    bool receive(Event& event, int timeout =(-1));
+
+private:
+    Stats statistics;
+
+    class Ring;
+    std::unique_ptr<Ring> ring;  // events from the drain thread to receive()
+    std::thread drainer;
+    void drain_loop(int read_delay, int nice) noexcept;
+
+    int add_watch(const std::string&, uint32_t, std::string_view, bool, bool, uint32_t);
+    int add_polled(const std::string&, uint32_t, std::string_view, bool, bool, uint32_t,
+	bool demoted =false);
+    void blind_spot(const std::string& path, int error);
+    bool attach(int wd, uint32_t parent, std::string_view name, bool recursive,
+	uint32_t mask);
+    void traverse(int dirfd, int wd);
+    void traverse_parallel(const std::string& path, int wd);
+    std::string relative(uint32_t parent, std::string_view name, std::string& root) const;
+    bool excluded(uint32_t parent, std::string_view name, bool& recursive);
+    bool included(uint32_t parent, const char* name) const;
+    void rewatch(uint32_t slot);
+    static bool split(const std::string& path, std::string& dir, std::string& name);
+    void watch_file(uint32_t slot, const std::string& name, uint32_t mask, bool own);
+    uint32_t lookup(const std::string& dir);
+    bool named(uint32_t slot, std::string_view path) const noexcept;
+
+    void pend(Pending it);
+    bool follow(const inotify_event& event);
+    void repend(std::vector<Pending> moving);
+    void release(int wd) noexcept;
+    bool waited_on(int wd) const noexcept {
+	return std::any_of(pending.begin(), pending.end(),
+	    [wd](const Pending& it) { return it.wd == wd; });
     }
 
-    // If we are IN_CREATEd, we traverse our immediate children (both files and 
-    // subdirectories) and we prepare them to be reported as IN_CREATEd by the read(), 
-    // which may possibly get a duplicate event for some of them from the system but will 
-    // not miss any. We do not recurse into any child subdirectories here because read() 
-    // will do, but a duplicate recurse of read() due to a duplicate event from the 
-    // system will be checked out by the previous "ignored as a duplicate" filtering.
-    else {  // if we are IN_CREATEd,
-	for ( const fs::path& path: fs::directory_iterator(path) )
-	    if ( !fs::is_other(path) ) {
-		// if a directory, a regular file, or a symlink, but not device file, 
-		// fifo, or socket,
+    bool wait(int timeout, int read_delay);
+    bool fill(const char*& where);
+    void run_commands();
+    bool linger(int read_delay);
+    static void signal(int fd) noexcept {
+	// Signal the eventfd.
+	const uint64_t one = 1;
+	while ( ::write(fd, &one, sizeof(one)) == -1 && errno == EINTR ) {}
+    }
+    static bool uncancel(int fd) noexcept {
+	// Clear the eventfd signaled, such as by cancel(), which always returns true.
+	uint64_t count;
+	while ( ::read(fd, &count, sizeof(count)) > 0 ) {}
+	return true;
+    }
+    bool resize_buffer();
+    void adapt_delay() noexcept;
+    const inotify_event* next();
+    Event resolve(const inotify_event& event) const;
+    template <typename Container>
+    static auto resolves(int) ->
+	decltype(std::declval<Container&>().push_back(std::declval<Event>()), std::true_type());
+    template <typename Container>
+    static std::false_type resolves(...);
+	// Tell if the Container takes Events rather than pointers, like vector<Event>.
+    template <typename Container>
+    void append(Container& events, const inotify_event* event) {
+	if constexpr ( decltype(resolves<Container>(0))::value )
+	    events.push_back(resolve(*event));
+	else
+	    events.push_back(event);
+    }
 
-		// Make a new IN_CREATE event to be read().
-		const bool isdir = fs::is_directory(path);
-		if ( mask & IN_CREATE || isdir && recursive ) {
-		    const std::string& name = path.filename().string();
-		    const uint32_t len =
-			(name.size()+sizeof(int))/sizeof(int)*sizeof(int);
-			// length including '\0' that fits in word boundary
-		    inotify_event& event =
-			*(inotify_event*)((char*)buffer + bytes_in_buffer);
-		    bytes_in_buffer += sizeof(inotify_event) + len;
-		    if ( bytes_in_buffer > sizeof(buffer) ) {
-			log("Error: add_watch() - Buffer underruns");
-			throw std::system_error(EINVAL, std::system_category());
-		    }
-		    event.wd = wd;
-		    event.mask = isdir ? IN_ISDIR | IN_CREATE : IN_CREATE;
-		    event.cookie = 0;
-		    event.len = len;
-		    name.copy(event.name, len);
-		    event.name[name.size()] = '\0';
-		}
-	    }
+    void recover();
+    void rescan(int dirfd, uint32_t slot, std::time_t since, bool changed);
+    void remove(uint32_t slot) noexcept;
+    void synthesize(int wd, uint32_t mask, const char* name, std::size_t size,
+	uint32_t cookie =0);
+
+    int poll_due();
+    int poll_dir(int wd);
+    bool list(int dirfd, std::vector<Entry>& entries, int& ops);
+    void stat_entries(int dirfd, std::vector<Entry>& entries, int& ops);
+    bool diff(int wd, const std::vector<Entry>& old, const std::vector<Entry>& fresh);
+    void vanish(uint32_t slot);
+
+    static unsigned long sysctl(const char* name, unsigned long otherwise) noexcept {
+	// Read /proc/sys/fs/inotify/name, or return otherwise if failed.
+	unsigned long value = otherwise;
+	if ( std::FILE* const file =
+	    std::fopen(("/proc/sys/fs/inotify/" + std::string(name)).c_str(), "r") ) {
+	    if ( std::fscanf(file, "%lu", &value) != 1 )
+		value = otherwise;
+	    std::fclose(file);
+	}
+	return value;
+    }
+    bool full() const noexcept {
+	return budget.limit && watches.count(false) >= budget.limit;
+    }
+    bool demoted(uint32_t slot) const {
+	const auto found = polls.find(watches[slot].wd);
+	return found != polls.end() && found->second.demoted;
+    }
+    static constexpr std::size_t max_demotions = 256;  // kernel watches per rebudget()
+    void rebudget();
+    std::size_t demote(std::size_t count);
+    void demote_subtree(uint32_t slot);
+    void promote_subtree(uint32_t slot);
+    void schedule(int wd, Poll& poll, int delay) {
+	poll.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+	poller.schedule.emplace(poll.due, wd);
     }
 
-    return wd;  // return wd of only the top directory
-}
+    static uint32_t watch_mask(uint32_t mask, bool recursive) noexcept {
+	return mask | IN_ONLYDIR | IN_MOVE_SELF | (recursive ? IN_CREATE | IN_MOVED_TO : 0);
+	    // IN_ONLYDIR is to set up a watch on directory only.
+    }
+    void erase(Watch& watch) noexcept;
+};
 
 template <typename Log>
-void Inotify<Log>::rm_watch(int wd) noexcept
-// Remove the watch associated with wd, and then IN_IGNORED event will be generated for 
-// this wd.
-{
-    if ( inotify_rm_watch(fd, wd) )  // == -1
-	log("Warning: inotify_rm_watch():%d - %s", errno, std::strerror(errno));
-}
+class Inotify<Log>::Batch {
+// Range of the events that are ready at a single wakeup, which is returned from events() 
+// and can be iterated over only once, like:
+//     for ( const inotify_event& event: inotify.events() ) ...
+// The events remain valid until the next call to read(), read_batch(), or events().
+    Inotify& inotify;
+    const inotify_event* const first;
+
+public:
+    class iterator {
+	Inotify* inotify;
+	const inotify_event* event;  // nullptr at the end
+
+    public:
+	using iterator_category = std::input_iterator_tag;
+	using value_type = inotify_event;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const inotify_event*;
+	using reference = const inotify_event&;
+
+	iterator(Inotify* inotify, const inotify_event* event) noexcept:
+	    inotify { inotify }, event { event } {}
+
+	reference operator*() const noexcept { return *event; }
+	pointer operator->() const noexcept { return event; }
+	iterator& operator++() { event = inotify->next(); return *this; }
+	bool operator==(const iterator& other) const noexcept { return event == other.event; }
+	bool operator!=(const iterator& other) const noexcept { return event != other.event; }
+    };
+
+    Batch(Inotify& inotify, const inotify_event* first) noexcept:
+	inotify { inotify }, first { first } {}
+
+    iterator begin() const noexcept { return { &inotify, first }; }
+    iterator end() const noexcept { return { &inotify, nullptr }; }
+};
 
 template <typename Log>
-void Inotify<Log>::rm_all_watches() noexcept
-// Delete all watches.
-// Unlike ~Inotify(), we can continue to use .add_watch() and .read().
+auto Inotify<Log>::events(int timeout, int read_delay) -> Batch
+// Wait for the first event as read() does, and return the range of all the events that 
+// are ready, which is empty if timed out.
 {
-    for ( const auto& it: watches )
-	rm_watch(it.first);  // calls rm_watch() for each key in watches
+    return Batch { *this, read(timeout, read_delay) };
 }
 
 template <typename Log>
-const inotify_event* Inotify<Log>::read(int timeout, int read_delay)
-// Read one inotify event from fd, or return nullptr if timed out.
-// Will throw an exception when an error is returned from poll() or read().
-
-// The read_delay: The time in milliseconds to wait after the first event arrives before 
-// reading the buffer. This allows further events to accumulate before reading, which 
-// allows the kernel to consolidate like events and can enhance performance when there 
-// are many similar events. The read_delay should be in [0..1000], or may cause a 
-// run-time exception.
-// If no watches are set up, read() will still run ok and will wait for nothing.
-// Todo: Handle IN_Q_OVERFLOW and restart the daemon.
-{
-    const auto then = std::chrono::system_clock::now();  // check starting time
-
-    // If the buffer underruns, (re)fill it by reading more events from read().
-    if ( bytes_in_buffer == 0 ) {
-	const char* where;
-
-	where = "poll()";
-	switch ( poll(&fds, 1, timeout) ) {
-	    case 0:  // timed out!
-		return nullptr;
+class Inotify<Log>::Ring {
+// Bounded lock-free queue of Events from a single producer (the drain thread) to a 
+// single consumer (receive()).
+// Each side sleeps on its own eventfd only when the ring is full or empty, and the other 
+// side signals it only when it finds the sleeper flag set, so that no system calls are 
+// made while both sides keep up.
+    std::vector<Event> slots;
+    const std::size_t capacity_mask;
+    alignas(64) std::atomic<std::size_t> head { 0 };  // next slot to pop, by the consumer
+    alignas(64) std::atomic<std::size_t> tail { 0 };  // next slot to push, by the producer
+    alignas(64) std::atomic<bool> consumer_waiting { false }, producer_waiting { false };
 
-	    default:  // or, "case 1:" and events are ready!
-		where = "usleep()";
-		if ( usleep(read_delay*1000u) != -1 ) {
-		    where = "read()";
-		    bytes_in_buffer = ::read(fd, buffer, sizeof(buffer));
-		    if ( bytes_in_buffer > 0 )
-			break;
-		    if ( bytes_in_buffer == 0 )
-			// EOF reached. Possibly too many events occurred at once?
-			errno = EIO;
-		}
-		// intentional fall-through
+public:
+    const int ready_fd;  // signaled when the ring is no longer empty
+    const int space_fd;  // signaled when the ring is no longer full
+    const int stop_fd;  // signaled to stop the producer
+    std::atomic<bool> stopped { false };  // the producer has stopped, by stop_fd or error
+    std::exception_ptr error;  // what stopped the producer, if any
+    std::atomic<std::size_t> high_water { 0 };  // written by the producer only
 
-	    case -1:  // error in system call
-		log("Error: %s:%d - %s", where, errno, std::strerror(errno));
-		throw std::system_error(errno, std::system_category());
+    explicit Ring(std::size_t capacity):
+	slots(std::size_t(1) << (64 - __builtin_clzll(std::max<std::size_t>(capacity, 2) - 1))),
+	capacity_mask { slots.size() - 1 },
+	ready_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+	space_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) },
+	stop_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) }
+    {
+	if ( ready_fd == -1 || space_fd == -1 || stop_fd == -1 ) {
+	    const int error = errno;
+	    close(ready_fd);
+	    close(space_fd);
+	    close(stop_fd);
+	    throw std::system_error(error, std::system_category());
 	}
     }
+    ~Ring() { close(ready_fd); close(space_fd); close(stop_fd); }
 
-    do {
-	const inotify_event& event =
-	    *(inotify_event*)((char*)buffer + bytes_handled);
-
-	bytes_handled += sizeof(inotify_event) + event.len;
-	if ( bytes_handled >= bytes_in_buffer ) {
-	    if ( bytes_handled > bytes_in_buffer ) {  // sanity check
-		// An incomplete event was read from read(). This is not to happen, but 
-		// we just report the same failure that read() would do in case the 
-		// buffer is too small to hold an event.
-		log("Error: read() - Incomplete event returned");
-		throw std::system_error(EINVAL, std::system_category());
+    bool push(Event&& event) noexcept {
+	// Push the event, waiting for space if full, or return false if stopped.
+	const std::size_t t = tail.load(std::memory_order_relaxed);
+	while ( t - head.load(std::memory_order_acquire) > capacity_mask ) {
+	    producer_waiting.store(true);
+	    if ( t - head.load() <= capacity_mask ) {  // re-check, not to miss a signal
+		producer_waiting.store(false);
+		break;
+	    }
+	    pollfd fds[2] = { { space_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+	    if ( poll(fds, 2, -1) > 0 ) {
+		if ( fds[1].revents & POLLIN )
+		    return false;
+		uncancel(space_fd);
 	    }
-	    bytes_handled = bytes_in_buffer = 0;
 	}
+	slots[t & capacity_mask] = std::move(event);
+	tail.store(t + 1);
+	const std::size_t held = t + 1 - head.load(std::memory_order_relaxed);
+	if ( held > high_water.load(std::memory_order_relaxed) )
+	    high_water.store(held, std::memory_order_relaxed);
+	if ( consumer_waiting.load() && consumer_waiting.exchange(false) )
+	    signal(ready_fd);
+	return true;
+    }
+
+    bool pop(Event& event) noexcept {
+	// Pop an event into the event, or return false if empty.
+	const std::size_t h = head.load(std::memory_order_relaxed);
+	if ( h == tail.load(std::memory_order_acquire) )
+	    return false;
+	event = std::move(slots[h & capacity_mask]);
+	head.store(h + 1);
+	if ( producer_waiting.load() && producer_waiting.exchange(false) )
+	    signal(space_fd);
+	return true;
+    }
 
-	const auto it = watches.find(event.wd);
-	if ( it == watches.end() ) {  // sanity check
-	    log("Error: read() - Event for unknown wd [%d] possibly due to IN_Q_OVERFLOW",
-		event.wd);
-	    throw std::system_error(EINVAL, std::system_category());
+    bool empty_or_wait() noexcept {
+	// Announce that the consumer is going to sleep on ready_fd, and return true if the 
+	// ring is still empty, in which case the consumer should sleep.
+	consumer_waiting.store(true);
+	if ( head.load(std::memory_order_relaxed) != tail.load() ) {
+	    consumer_waiting.store(false);
+	    return false;
 	}
-	Watch& watch = it->second;
-	printf("- [%d] %s (%#x)\n", event.wd,
-	    (event.len ? watch.path/event.name : watch.path).c_str(), event.mask);
+	return true;
+    }
+};
 
-	// A new subdirectory was created or moved in.
-	if ( event.mask & (IN_CREATE | IN_MOVED_TO) &&
-	    event.mask & IN_ISDIR &&
-	    watch.path.back() != '/' ) {
-	    const bool in_move = event.mask & IN_MOVED_TO;  // will cast to 0 or 1.
-	    const int wd = add_watch(watch.path/event.name, in_move);
-	    // The event.name here will be non-empty for IN_CREATE and IN_MOVED_TO.
-	    // When a watch is moved into another directory, the watch is retained only 
+template <typename Log>
+void Inotify<Log>::drain(std::size_t capacity, int read_delay, int cpu, int nice)
+// Start a thread that drains events from kernel as fast as possible, keeping the watches 
+// up to date, and hands the events resolved with their full pathnames to receive() 
+// through a ring of capacity events (rounded up to a power of 2).
+// The cpu pins the thread to the CPU, unless -1, and the nice sets its nice value, which 
+// may need a privilege to be raised.
+// While draining, the thread owns the watches and the buffer, so no other member 
+// functions but receive(), cancel(), post(), stop_drain(), and ring_high_water() should 
+// be called. stats() can be read through post() then, or after stop_drain().
+{
+    if ( drainer.joinable() )
+	return;  // already draining.
+    ring.reset(new Ring(capacity));
+    fds[1].fd = ring->stop_fd;  // The drain thread waits to be stopped instead of cancel().
+    drainer = std::thread(&Inotify::drain_loop, this, read_delay, nice);
+
+    if ( cpu >= 0 ) {
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if ( const int error =
+	    pthread_setaffinity_np(drainer.native_handle(), sizeof(cpus), &cpus) )
+	    log("Warning: pthread_setaffinity_np():%d - %s", error, std::strerror(error));
+    }
+}
+
+template <typename Log>
+auto Inotify<Log>::resolve(const inotify_event& event) const -> Event
+// Resolve the event just returned from next() with its full pathname, before the events 
+// after it change the watches. The path is empty for IN_Q_OVERFLOW or a watch gone.
+{
+    const Watch* const watch = watches.find(event.wd);
+    std::string path = watch ? this->path(event.wd) : std::string();
+    if ( event.len )
+	path = path/event.name;
+    return Event { event.wd, event.mask, event.cookie, std::move(path) };
+}
+
+template <typename Log>
+void Inotify<Log>::drain_loop(int read_delay, int nice) noexcept
+// Body of the drain thread.
+{
+    if ( nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) == -1 )
+	log("Warning: setpriority():%d - %s", errno, std::strerror(errno));
+
+    try {
+	for ( bool stopped = false ; !stopped ; ) {
+	    const inotify_event* event = read(-1, read_delay);
+	    if ( !event )
+		break;  // stopped while waiting for events
+	    do
+		stopped = !ring->push(resolve(*event));  // or while waiting for room
+	    while ( !stopped && (event = next()) );
+	}
+    }
+    catch (...) {
+	ring->error = std::current_exception();
+    }
+    ring->stopped = true;
+    signal(ring->ready_fd);  // Wake up receive() to find out we have stopped.
+}
+
+template <typename Log>
+void Inotify<Log>::stop_drain() noexcept
+// Stop the drain thread, if any. The events left in the ring can still be received.
+{
+    if ( !drainer.joinable() )
+	return;
+    signal(ring->stop_fd);
+    drainer.join();
+    fds[1].fd = wake_fd;
+    statistics.ring_high_water = std::max(statistics.ring_high_water, ring->high_water.load());
+}
+
+template <typename Log>
+bool Inotify<Log>::receive(Event& event, int timeout)
+// Receive an event from the drain thread, or return false if timed out, cancelled by 
+// cancel(), or the drain thread has stopped with the ring empty.
+// Will rethrow the exception that has stopped the drain thread, if any.
+{
+    if ( !ring )
+	return false;
+    const auto then = std::chrono::steady_clock::now();
+    for ( int time_left = timeout ; ; ) {
+	if ( ring->pop(event) )
+	    return true;
+	if ( ring->stopped ) {
+	    if ( ring->pop(event) )  // one more time for the events pushed before stopping
+		return true;
+	    if ( ring->error )
+		std::rethrow_exception(std::exchange(ring->error, nullptr));
+	    return false;
+	}
+	if ( !ring->empty_or_wait() )
+	    continue;
+
+	pollfd fds[2] = { { ring->ready_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+	switch ( poll(fds, 2, time_left) ) {
+	    case 0:  // timed out!
+		return false;
+	    case -1:
+		log("Error: poll():%d - %s", errno, std::strerror(errno));
+		throw std::system_error(errno, std::system_category());
+	    default:
+		if ( fds[1].revents & POLLIN )
+		    return !uncancel(wake_fd);
+		uncancel(ring->ready_fd);
+	}
+	if ( timeout >= 0 /* != -1 */ ) {
+	    // A wakeup may be left over from an event we have popped already.
+	    time_left = timeout - std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - then).count();
+	    if ( time_left < 0 )
+		time_left = 0;  // to pop once more.
+	}
+    }
+}
+
+template <typename Log>
+auto Inotify<Log>::Watches::emplace(int wd, std::string_view name, bool recursive,
+    uint32_t mask)
+    -> Watch&
+{
+    uint32_t slot = free_slot;
+    if ( slot != none )
+	free_slot = slots[slot].next_sibling;
+    else {
+	slot = slots.size();
+	slots.emplace_back();
+    }
+
+    std::vector<uint32_t>& table = wd >= 0 ? index : pseudo_index;
+    if ( position(wd) >= table.size() )
+	table.resize(position(wd) + 1, none);
+    table[position(wd)] = slot;
+
+    Watch& watch = slots[slot];
+    watch = Watch { wd, none, none, none, none, alloc_name(name), uint16_t(name.size()),
+	recursive, false, 0, mask };
+    ++counts[wd < -1];
+    return watch;
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::rekey(Watch& watch, int wd)
+{
+    const uint32_t slot = this->slot(watch);
+    (watch.wd >= 0 ? index : pseudo_index)[position(watch.wd)] = none;
+    --counts[watch.wd < -1];
+    std::vector<uint32_t>& table = wd >= 0 ? index : pseudo_index;
+    if ( position(wd) >= table.size() )
+	table.resize(position(wd) + 1, none);
+    table[position(wd)] = slot;
+    ++counts[wd < -1];
+    watch.wd = wd;
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::rename(Watch& watch, std::string_view name)
+{
+    if ( (name.size()+7)/8 == (watch.name_size+7)/8u )  // if fits in the same block,
+	name.copy(&names[watch.name], name.size());
+    else {
+	free_name(watch.name, watch.name_size);
+	watch.name = alloc_name(name);
+    }
+    watch.name_size = name.size();
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::erase(Watch& watch) noexcept
+// The watch should have been unlinked already.
+{
+    const uint32_t slot = this->slot(watch);
+    (watch.wd >= 0 ? index : pseudo_index)[position(watch.wd)] = none;
+    --counts[watch.wd < -1];
+    free_name(watch.name, watch.name_size);
+    watch.wd = -1;
+    watch.next_sibling = free_slot;
+    free_slot = slot;
+}
+
+template <typename Log>
+uint32_t Inotify<Log>::Watches::alloc_name(std::string_view name)
+{
+    const std::size_t size_class = (name.size()+7) / 8;
+    if ( size_class >= free_names.size() )
+	free_names.resize(size_class + 1, none);
+
+    uint32_t offset = free_names[size_class];
+    if ( offset != none )
+	std::memcpy(&free_names[size_class], &names[offset], sizeof(uint32_t));
+    else {
+	offset = names.size();
+	names.resize(offset + std::max<std::size_t>(size_class, 1) * 8);
+	    // An empty name also takes a block so that it can hold the free list link.
+    }
+    name.copy(&names[offset], name.size());
+    return offset;
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::free_name(uint32_t offset, std::size_t size) noexcept
+{
+    const std::size_t size_class = (size+7) / 8;
+    std::memcpy(&names[offset], &free_names[size_class], sizeof(uint32_t));
+    free_names[size_class] = offset;
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::link(Watch& watch, uint32_t parent) noexcept
+// Link the watch as the first child of the parent watch, or as a root watch if parent 
+// is none.
+{
+    watch.parent = parent;
+    watch.prev_sibling = none;
+    watch.next_sibling = none;
+    if ( parent != none ) {
+	Watch& up = slots[parent];
+	if ( up.first_child != none ) {
+	    slots[up.first_child].prev_sibling = slot(watch);
+	    watch.next_sibling = up.first_child;
+	}
+	up.first_child = slot(watch);
+    }
+}
+
+template <typename Log>
+void Inotify<Log>::Watches::unlink(Watch& watch) noexcept
+// Unlink the watch from its parent watch (if any), but with its children retained.
+{
+    if ( watch.prev_sibling != none )
+	slots[watch.prev_sibling].next_sibling = watch.next_sibling;
+    else if ( watch.parent != none )
+	slots[watch.parent].first_child = watch.next_sibling;
+    if ( watch.next_sibling != none )
+	slots[watch.next_sibling].prev_sibling = watch.prev_sibling;
+    watch.parent = watch.prev_sibling = watch.next_sibling = none;
+}
+
+template <typename Log>
+template <typename F>
+void Inotify<Log>::Watches::for_each_in_subtree(uint32_t slot, F f) const
+// Call f(watch) for every watch in the subtree rooted at slot, in post-order, that is, 
+// children before their parent.
+// The f should not change the structure of the tree.
+{
+    const uint32_t top = slot;
+    for (;;) {
+	while ( slots[slot].first_child != none )
+	    slot = slots[slot].first_child;  // goes down to the leftmost leaf.
+
+	for (;;) {
+	    const Watch& watch = slots[slot];
+	    f(watch);
+	    if ( slot == top )
+		return;
+	    if ( watch.next_sibling != none ) {
+		slot = watch.next_sibling;
+		break;
+	    }
+	    slot = watch.parent;
+	}
+    }
+}
+
+template <typename Log>
+std::string Inotify<Log>::path(int wd) const
+// Build the full pathname of the watch by walking up to its root watch.
+// Will throw an out_of_range exception if wd is not existing.
+{
+    const Watch* watch = &watches.at(wd);
+    if ( watch->parent == Watches::none )
+	return std::string(watches.name(*watch));
+
+    std::vector<const Watch*> ancestors;
+    std::size_t size = 0;
+    do {
+	ancestors.push_back(watch);
+	size += watch->name_size + 1;
+	watch = &watches[watch->parent];
+    } while ( watch->parent != Watches::none );
+
+    std::string path;
+    path.reserve(watch->name_size + size);
+    path = watches.name(*watch);
+    for ( auto it = ancestors.rbegin() ; it != ancestors.rend() ; ++it ) {
+	if ( path.back() != '/' )  // if not the root directory "/",
+	    path += '/';
+	path += watches.name(**it);
+    }
+    return path;
+}
+
+template <typename Log>
+void Inotify<Log>::erase(Watch& watch) noexcept
+// Erase the watch from the dictionary.
+// Its children (if any) are normally erased before it is, since kernel removes watches 
+// of a directory tree from the bottom up and so do we in read(). If not, they are 
+// turned into root watches with their full pathnames so that path() will still work 
+// for them until they are erased too.
+{
+    while ( watch.first_child != Watches::none ) {
+	Watch& orphan = watches[watch.first_child];
+	watches.rename(orphan, path(orphan.wd));
+	watches.unlink(orphan);
+    }
+    if ( watch.wd < -1 )
+	polls.erase(watch.wd);
+    if ( !files.empty() )
+	files.erase(watches.slot(watch));
+    watches.unlink(watch);
+    watches.erase(watch);
+}
+
+template <typename Log>
+void Inotify<Log>::exclude(const std::string& root, const std::string& pattern)
+// Leave the subdirectories matching the pattern unwatched, together with everything below 
+// them, under the root watch on the root pathname, which should be given before the root 
+// watch is added. They are pruned before even inotify_add_watch() or reading them, both 
+// at the setup of the root and when they are created or moved in later.
+// The pattern is as in .gitignore: a pattern with no '/' but at the end matches the name 
+// of a directory at any level, like "node_modules", and any other is matched against the 
+// pathname relative to the root, like ".git/objects" or "/build" (see glob() for the 
+// wildcards). Negation by '!' is not supported, and comments and blank lines are ignored.
+{
+    std::string name = root;
+    while ( name.size() > 1 && name.back() == '/' )
+	name.pop_back();  // as the root watch is named
+    std::string glob = pattern;
+    while ( !glob.empty() && glob.back() == '/' )
+	glob.pop_back();  // Only directories are watched anyway.
+    if ( glob.empty() || glob[0] == '#' )
+	return;
+    if ( glob[0] == '!' ) {
+	log("Warning: Cannot exclude \"%s\": negation not supported", pattern.c_str());
+	return;
+    }
+
+    Excludes& rules = excludes[name];
+    if ( glob.find('/') == std::string::npos )
+	rules.names.push_back(std::move(glob));
+    else
+	rules.paths.push_back(glob[0] == '/' ? glob.substr(1) : std::move(glob));
+}
+
+template <typename Log>
+std::string Inotify<Log>::relative(uint32_t parent, std::string_view name,
+    std::string& root) const
+// Return the pathname of the name under the parent watch (given as its slot), relative to 
+// its root watch, whose pathname is set to root.
+{
+    std::vector<uint32_t> ancestors;  // below the root, from the bottom up
+    uint32_t top = parent;
+    for ( ; watches[top].parent != Watches::none ; top = watches[top].parent )
+	ancestors.push_back(top);
+    root = watches.name(watches[top]);
+
+    std::string path;
+    for ( auto it = ancestors.rbegin() ; it != ancestors.rend() ; ++it )
+	(path += watches.name(watches[*it])) += '/';
+    return path += name;
+}
+
+template <typename Log>
+bool Inotify<Log>::excluded(uint32_t parent, std::string_view name, bool& recursive)
+// Tell if the subdirectory of the name under the parent watch (given as its slot) is left 
+// unwatched by the exclude rules or by the include globs of its root watch, counting it 
+// if so. Otherwise, recursive is cleared if the globs can match nothing below it.
+{
+    if ( excludes.empty() && includes.empty() )
+	return false;
+    std::string root;
+    const std::string path = relative(parent, name, root);
+    const auto rules = excludes.find(root);
+    const auto plan = includes.find(root);
+    const typename Includes::Fit fit =
+	plan != includes.end() ? plan->second.fit(path) : Includes::inner;
+
+    if ( fit != Includes::none && (rules == excludes.end() || !rules->second.match(path)) ) {
+	if ( fit == Includes::leaf )
+	    recursive = false;
+	return false;
+    }
+    printf("%s/%s excluded\n", root.c_str(), path.c_str());
+    ++statistics.excluded;
+    return true;
+}
+
+template <typename Log>
+bool Inotify<Log>::included(uint32_t parent, const char* name) const
+// Tell if the entry of the name under the parent watch (given as its slot) matches any 
+// include glob of its root watch, or if the root has none.
+{
+    if ( includes.empty() )
+	return true;
+    uint32_t top = parent;
+    while ( watches[top].parent != Watches::none )
+	top = watches[top].parent;
+    const std::string_view pathname = watches.name(watches[top]);
+
+    // The plan is looked up once for each root, rather than building its pathname at 
+    // every event, and again if the slot is taken by another root since.
+    auto& [root, plan] = plans[top];
+    if ( root != pathname ) {  // not looked up yet, or for another root
+	root = pathname;
+	const auto found = includes.find(root);
+	plan = found != includes.end() ? &found->second : nullptr;
+    }
+    if ( !plan )
+	return true;
+    std::string unused;
+    return plan->match(relative(parent, name, unused));
+}
+
+template <typename Log>
+int Inotify<Log>::add_glob(const std::string& pattern, bool in_move, uint32_t mask)
+// Add a root watch for the entries matching the pattern, like "/srv/logs/*/app-*/**/*.log", 
+// as add_watch() does, and return its wd.
+// The root is at the directory named by the components of the pattern before the first 
+// one with a wildcard ("/srv/logs" here), and the rest is planned ahead so that only the 
+// directories that can contain a match are watched: each of the "*" is watched, each 
+// "app-*" in them, and everything below these for "**", but no others. A directory that 
+// can contain a match but none of its subdirectories can, such as "/etc/app" for 
+// "/etc/app/*.conf", has a non-recursive watch, and the depth is capped without "**".
+// Then, only the events for the entries matching the pattern (and those for the watched 
+// directories themselves, with no name) are reported by read(), and all if the mask asks.
+// Other globs under the same root should be added before the root is watched, since the 
+// directories watched already are not planned again.
+// Note, exclude() still applies to the root.
+{
+    std::string glob = pattern;
+    while ( glob.size() > 1 && glob.back() == '/' )
+	glob.pop_back();
+    std::size_t end = glob.find_first_of("*?[\\");
+    end = end == std::string::npos ? glob.rfind('/') : glob.rfind('/', end);
+    const std::string root =
+	end == std::string::npos ? "." : end == 0 ? "/" : glob.substr(0, end);
+    glob.erase(0, end == std::string::npos ? 0 : end + 1);
+    if ( glob.empty() ) {
+	log("Warning: Cannot watch \"%s\": %s", pattern.c_str(), std::strerror(ENOENT));
+	return -1;
+    }
+
+    std::vector<std::string> dir;
+    for ( std::size_t at = 0 ; ; ) {
+	const std::size_t slash = glob.find('/', at);
+	if ( slash == std::string::npos ) {
+	    if ( glob.compare(at, std::string::npos, "**") == 0 )
+		dir.push_back("**");
+	    break;
+	}
+	if ( slash > at )
+	    dir.push_back(glob.substr(at, slash - at));
+	at = slash + 1;
+    }
+
+    Includes& plan = includes[root];
+    plans.clear();  // which may have looked up the root without globs
+    plan.globs.push_back(std::move(glob));
+    plan.dirs.push_back(std::move(dir));
+    const bool recursive = plan.fit("") == Includes::inner;
+    return add_watch(recursive ? root : root + '/', in_move, mask);
+}
+
+template <typename Log>
+bool Inotify<Log>::split(const std::string& path, std::string& dir, std::string& name)
+// Split the pathname of a file into its directory and its name, or return false if it 
+// names no file but a directory.
+{
+    const std::size_t slash = path.rfind('/');
+    name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    while ( dir.size() > 1 && dir.back() == '/' )
+	dir.pop_back();
+    if ( dir.empty() )
+	dir = "/";
+    return !name.empty() && name != "." && name != "..";
+}
+
+template <typename Log>
+int Inotify<Log>::add_file(const std::string& path, uint32_t mask)
+// Watch the file of the path, which need not exist yet, for the events in the mask (or 
+// the common mask if 0), and return wd of its directory, for which its events are 
+// reported with its name.
+// The files of a directory share a single watch on it, whether the directory is watched 
+// already or not, and their events are told apart by name in a hash table. So, watching 
+// 100k files takes only as many watches as their directories, and no more time per 
+// event. A directory not watched otherwise is watched as add_watch() would with the path 
+// ending with '/', polled or kept pending as well, but only the events of its files are 
+// reported, and its IN_DELETE_SELF and IN_IGNORED, which end them; it reports its own 
+// events again once set_mask() gives it a mask. If it is kept pending, 0 is returned, 
+// and the file is watched once the directory comes.
+// A pattern of files, like "/etc/app/*.conf", is watched by add_glob() instead.
+{
+    std::string dir, name;
+    if ( !split(path, dir, name) ) {
+	log("Warning: Cannot watch \"%s\": %s", path.c_str(), std::strerror(EISDIR));
+	return -1;
+    }
+    if ( !mask )
+	mask = this->mask;
+
+    uint32_t slot = lookup(dir);
+    const bool ours = slot != Watches::none;
+    if ( !ours ) {
+	const auto waiting = [this, &dir] {
+	    return std::find_if(pending.begin(), pending.end(),
+		[&dir](const Pending& it) { return it.path == dir; });
+	};
+	auto it = waiting();
+	const bool own = it != pending.end();  // if pending for its own events already
+	const int wd = own ? 0 : add_watch(dir + '/', true, mask);
+	if ( wd == -1 )
+	    return -1;
+	if ( wd == 0 && (it = waiting()) != pending.end() ) {
+	    it->own = own;
+	    it->files.emplace_back(std::move(name), mask);
+	    return 0;
+	}
+	if ( wd == 0 && (slot = lookup(dir)) == Watches::none )
+	    return -1;  // which pend() has logged
+	if ( wd != 0 )
+	    slot = watches.slot(watches.at(wd));
+    }
+    watch_file(slot, name, mask, ours);
+    return watches[slot].wd;
+}
+
+template <typename Log>
+void Inotify<Log>::watch_file(uint32_t slot, const std::string& name, uint32_t mask,
+    bool own)
+// Watch the file of the name in the directory watched at slot, for the events in the 
+// mask, where own tells if the directory reports its own events as well.
+{
+    const auto [it, created] = files.try_emplace(slot);
+    if ( created ) {
+	it->second.mask = IN_DELETE_SELF;  // which always ends the files
+	it->second.own = own ? watches[slot].mask : 0;
+    }
+    it->second.masks[name] = mask;
+    it->second.mask |= mask;
+    if ( watches[slot].mask != (it->second.own | it->second.mask) ) {
+	watches[slot].mask = it->second.own | it->second.mask;
+	rewatch(slot);
+    }
+}
+
+template <typename Log>
+uint32_t Inotify<Log>::lookup(const std::string& dir)
+// Return the slot of the watch on the directory of the pathname, whether by kernel or by 
+// polling, or none if not watched.
+// Kernel returns wd of the watch on the directory if we have one, and the polled watches 
+// are compared by name.
+{
+    const int wd = inotify_add_watch(fd, dir.c_str(), IN_ONLYDIR | IN_MOVE_SELF | IN_MASK_ADD);
+    if ( wd != -1 ) {
+	if ( const Watch* const watch = watches.find(wd) )
+	    return watches.slot(*watch);
+	release(wd);  // which we have just added
+    }
+    for ( const auto& poll: polls ) {
+	const uint32_t slot = watches.slot(watches.at(poll.first));
+	if ( named(slot, dir) )
+	    return slot;
+    }
+    return Watches::none;
+}
+
+template <typename Log>
+bool Inotify<Log>::named(uint32_t slot, std::string_view path) const noexcept
+// Tell if the watch at slot has the pathname, comparing its names from the bottom up.
+{
+    for ( ; watches[slot].parent != Watches::none ; slot = watches[slot].parent ) {
+	const std::string_view name = watches.name(watches[slot]);
+	if ( path.size() <= name.size() ||
+	    path.compare(path.size() - name.size(), name.size(), name) != 0 ||
+	    path[path.size() - name.size() - 1] != '/' )
+	    return false;
+	path.remove_suffix(name.size() + 1);
+    }
+    const std::string_view root = watches.name(watches[slot]);
+    return path == root || (path.empty() && root == "/");
+}
+
+template <typename Log>
+void Inotify<Log>::rm_file(const std::string& path)
+// Stop watching the file of the path added by add_file(), and its directory as well if 
+// no other files are watched there and it is not watched otherwise.
+{
+    std::string dir, name;
+    if ( !split(path, dir, name) )
+	return;
+    const uint32_t slot = lookup(dir);
+    if ( slot == Watches::none ) {
+	// The directory may be pending with the file.
+	for ( Pending& it: pending )
+	    if ( it.path == dir ) {
+		const auto file = std::find_if(it.files.begin(), it.files.end(),
+		    [&name](const auto& file) { return file.first == name; });
+		if ( file != it.files.end() )
+		    it.files.erase(file);
+		if ( it.files.empty() && !it.own )
+		    rm_pending(dir);
+		return;
+	    }
+	return;
+    }
+    const auto it = files.find(slot);
+    if ( it == files.end() || !it->second.masks.erase(name) )
+	return;
+
+    if ( it->second.masks.empty() && !it->second.own ) {
+	rm_watch(watches[slot].wd);  // and files.erase() at IN_IGNORED
+	return;
+    }
+    it->second.mask = IN_DELETE_SELF;
+    for ( const auto& file: it->second.masks )
+	it->second.mask |= file.second;
+    const uint32_t kernel =
+	it->second.own | (it->second.masks.empty() ? 0 : it->second.mask);
+    if ( it->second.masks.empty() )
+	files.erase(it);
+    if ( watches[slot].mask != kernel ) {
+	watches[slot].mask = kernel;
+	rewatch(slot);
+    }
+}
+
+template <typename Log>
+int Inotify<Log>::add_watch(const std::string& path, bool in_move, uint32_t mask)
+// The given path is required to be non-empty string for an existing directory. 
+// Otherwise, it will be ignored, but with an error logged.
+// If the path already contains child files and subdirectories in it, the in_move flag 
+// comes in play. If true and if the path is recursive (that is, not ending with '/'), 
+// every subdirectory (but not file) will have its own watch set up recursively and 
+// implicitly without notifying. If false, regardless of whether the path is recursive or 
+// not, every (immediate) child file and subdirectory will be prepared to be reported as 
+// IN_CREATE by the next call to read() (but, in this case, read() may duplicately report 
+// the same IN_CREATE event for some files or directories, depending on how fast the path 
+// watch kicks in).
+// Note that the in_move flag is not just for IN_MOVED_TO'd watches, but also can be used 
+// for initial setup of watches on existing directories, which is why its default 
+// argument is set true.
+// The mask tells the events of interest under the path, or is the common mask given to 
+// the constructor if 0. It is set to every watch below, and inherited by the directories 
+// to come, so that kernel does not even queue the events of no interest there.
+// If pend_missing() is set and the path does not exist yet, the watch is kept pending and
+// 0 is returned, which no watch has, until the directory comes and is reported as an 
+// IN_CREATE | IN_ISDIR event for the new root wd itself, with an empty name (see pend()).
+// It can be given up by rm_pending() meanwhile.
+// A single file is watched by add_file() instead.
+{
+    if ( path.empty() ) {
+	log("Warning: Cannot watch \"\": %s", std::strerror(ENOENT));
+	return -1;
+    }
+
+    const bool recursive = path.back() != '/';
+    std::string name = path;
+    while ( name.size() > 1 && name.back() == '/' )
+	name.pop_back();  // The root watch is named without trailing '/'.
+    if ( !mask )
+	mask = this->mask;
+
+    struct stat st;
+    if ( pend_roots && stat(name.c_str(), &st) == -1 && errno == ENOENT ) {
+	pend(Pending { name, recursive, in_move, mask, -1, name.size() });
+	return 0;
+    }
+    return add_watch(name, Watches::none, name, recursive, in_move, mask);
+}
+
+template <typename Log>
+void Inotify<Log>::pend(Pending it)
+// Keep the root watch pending on the deepest ancestor of its path that exists, watched
+// with pending_mask, or add it at once if the path has come already.
+// When the next component of the path is created or moved into the ancestor, follow()
+// calls us again to go down one level (or more, if they have come already), and back up
+// if the ancestor itself is moved or deleted. No polling is involved at all. Once the
+// directory comes, it is added as add_watch() would, and reported as an IN_CREATE |
+// IN_ISDIR event for the new root wd itself, with an empty name, regardless of its mask.
+{
+    const std::string& path = it.path;
+    const auto prefix = [&path](std::size_t end) {
+	return end ? path.substr(0, end) : path[0] == '/' ? "/" : ".";
+    };
+    const auto up = [&path](std::size_t end) -> std::size_t {
+	const std::size_t slash = path.rfind('/', end - 1);
+	return slash == std::string::npos ? 0 : slash;
+    };
+    const auto down = [&path](std::size_t end) {
+	const std::size_t slash = path.find('/', path.find_first_not_of('/', end));
+	return slash == std::string::npos ? path.size() : slash;
+    };
+    const auto isdir = [](const std::string& path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    };
+
+    std::size_t end = path.size();
+    while ( end > 0 && !isdir(prefix(end)) )
+	end = up(end);
+
+    for (;;) {
+	if ( end == path.size() ) {
+	    const int wd = add_watch(it.recursive ? path : path + '/', it.in_move, it.mask);
+	    if ( wd != -1 && wd != 0 ) {  // unless failed, or gone and pending again
+		log("Info: %s watched, no longer pending", path.c_str());
+		for ( const auto& [name, mask]: it.files )
+		    watch_file(watches.slot(watches.at(wd)), name, mask, it.own);
+		if ( it.own )  // unless added only for files
+		    synthesize(wd, IN_ISDIR | IN_CREATE, "", 0);
+	    }
+	    return;
+	}
+
+	const std::string ancestor = prefix(end);
+	const int wd = inotify_add_watch(fd, ancestor.c_str(), pending_mask);
+	if ( wd == -1 ) {
+	    if ( end > 0 && (errno == ENOENT || errno == ENOTDIR) ) {
+		end = up(end);  // gone meanwhile
+		continue;
+	    }
+	    log("Warning: Cannot watch \"%s\": %s", ancestor.c_str(), std::strerror(errno));
+	    return;
+	}
+
+	// The next component may have come before the watch kicked in.
+	if ( isdir(prefix(down(end))) ) {
+	    release(wd);
+	    end = down(end);
+	    continue;
+	}
+
+	if ( it.wd == -1 )
+	    log("Info: %s pending on %s", path.c_str(), ancestor.c_str());
+	it.wd = wd;
+	it.end = end;
+	pending.push_back(std::move(it));
+	return;
+    }
+}
+
+template <typename Log>
+bool Inotify<Log>::follow(const inotify_event& event)
+// Move the pending watches waiting on the directory of event.wd down to the next component
+// of their paths, if the event tells it has come, or back up if the directory itself has
+// gone. Return true if any is waiting on it.
+{
+    bool found = false;
+    std::vector<Pending> moving;
+    for ( std::size_t i = 0 ; i < pending.size() ; ) {
+	const Pending& it = pending[i];
+	if ( it.wd != event.wd ) {
+	    ++i;
+	    continue;
+	}
+	found = true;
+
+	bool moved = event.mask & (IN_MOVE_SELF | IN_IGNORED);
+	if ( !moved && event.mask & IN_ISDIR && event.mask & (IN_CREATE | IN_MOVED_TO) &&
+	    event.len ) {
+	    const std::size_t start = it.path.find_first_not_of('/', it.end);
+	    const std::size_t size = std::min(it.path.find('/', start), it.path.size()) - start;
+	    moved = it.path.compare(start, size, event.name) == 0;
+	}
+	if ( moved ) {
+	    moving.push_back(std::move(pending[i]));
+	    pending.erase(pending.begin() + i);
+	}
+	else
+	    ++i;
+    }
+    if ( !moving.empty() )
+	repend(std::move(moving));
+    return found;
+}
+
+template <typename Log>
+void Inotify<Log>::repend(std::vector<Pending> moving)
+// Find again where the pending watches moving should wait, and release the ancestors no
+// longer waited on.
+{
+    std::vector<int> wds;
+    for ( Pending& it: moving ) {
+	wds.push_back(it.wd);
+	pend(std::move(it));
+    }
+    for ( const int wd: wds )
+	release(wd);
+}
+
+template <typename Log>
+void Inotify<Log>::release(int wd) noexcept
+// Remove the kernel watch on an ancestor of pending watches, unless any still waits on it
+// or it is a watch of ours.
+{
+    if ( !waited_on(wd) && !watches.find(wd) )
+	inotify_rm_watch(fd, wd);  // which fails if kernel has removed it already.
+}
+
+template <typename Log>
+bool Inotify<Log>::attach(int wd, uint32_t parent, std::string_view name, bool recursive,
+    uint32_t mask)
+// Register the wd returned from inotify_add_watch() into the watches table, named as the 
+// given name under the parent watch (given as its slot), or as a root watch if parent 
+// is none, in which case the name is its full pathname. The watch has been added with 
+// the mask, which goes to all the watches below it as well.
+// Return false if there is nothing new to traverse below the watch, that is, if it is a 
+// duplicate or a recursive watch that is just moved.
+{
+    Watch* const found = watches.find(wd);
+    if ( !found ) {
+	watches.link(watches.emplace(wd, name, recursive, mask), parent);
+	printf("[%d] %s created\n", wd, path(wd).c_str());
+	return true;
+    }
+
+    // The inotify_add_watch() will return wd of an existing watch if there already 
+    // exists a watch for the given path, in which case we determine the watch is moved 
+    // rather than created newly.
+
+    Watch& watch = *found;
+    bool traverse = true;
+    if ( (watch.parent == parent && watches.name(watch) == name) ||
+	(parent == Watches::none && path(wd) == name) ) {
+	// Do nothing if the same path is added again, unless it turns from 
+	// non-recursive into recursive.
+	if ( watch.recursive || !recursive ) {
+	    printf("[%d] %s ignored as a duplicate\n", wd, path(wd).c_str());
+	    set_mask(wd, mask);
+	    return false;
+	}
+	printf("[%d] %s changed to recursive\n", wd, path(wd).c_str());
+    }
+
+    else {
+	for ( uint32_t up = parent ; up != Watches::none ; up = watches[up].parent )
+	    if ( up == watches.slot(watch) ) {
+		// The directory appears again inside itself, such as through a bind 
+		// mount, which we should not follow.
+		printf("[%d] %s ignored as a loop\n", wd, path(wd).c_str());
+		return false;
+	    }
+
+	watches.unlink(watch);
+	watches.rename(watch, name);
+	watches.link(watch, parent);
+	printf("[%d] %s moved\n", wd, path(wd).c_str());
+
+	// A recursive watch that is moved already has all its subdirectories watched 
+	// and linked under it, so we do not need to traverse them again.
+	if ( watch.recursive && recursive )
+	    traverse = false;
+	else if ( watch.recursive )  // if it turns into a non-recursive watch,
+	    while ( watch.first_child != Watches::none ) {
+		Watch& child = watches[watch.first_child];
+		watches.for_each_in_subtree(watches.slot(child),
+		    [this](const Watch& watch) { rm_watch(watch.wd); });
+		watches.unlink(child);
+	    }
+	    // The unlinked subtrees will be erased at their IN_IGNORED events.
+    }
+    watch.recursive = recursive;
+    //watch.in_move = false;  // not necessary
+    set_mask(wd, mask);  // A subtree moved in takes the mask of its new parent.
+    return traverse;
+}
+
+template <typename Log>
+int Inotify<Log>::add_watch(const std::string& path, uint32_t parent,
+    std::string_view name, bool recursive, bool in_move, uint32_t mask)
+// Set up a watch for the path with the mask, which is named as the given name under the 
+// parent watch (given as its slot), or is a root watch if parent is none.
+// recursive will be always true if called from read().
+// Return -1 if it is not watched, including if excluded by exclude().
+{
+    if ( parent != Watches::none && excluded(parent, name, recursive) )
+	return -1;
+    if ( parent == Watches::none ? polled(path) : watches[parent].wd < -1 )
+	return add_polled(path, parent, name, recursive, in_move, mask,
+	    parent != Watches::none && demoted(parent));
+	    // A directory come under a demoted watch is polled as demoted too.
+    if ( full() )
+	return add_polled(path, parent, name, recursive, in_move, mask, true);
+
+    const int wd = inotify_add_watch(fd, path.c_str(), watch_mask(mask, recursive));
+
+    if ( wd == -1 && errno == ENOSPC ) {  // if out of max_user_watches,
+	budget.limit = watches.count(false);  // which we know better now.
+	return add_polled(path, parent, name, recursive, in_move, mask, true);
+    }
+    if ( wd == -1 ) {  // if non-directory, non-existing, or without read-permission,
+	//log("Warning: Cannot watch \"%s\": %m", path.c_str());
+	    // We can use "%m" for strerror(errno) if log is Syslog<> function object.
+	blind_spot(path, errno);
+	return wd;
+    }
+
+    if ( !attach(wd, parent, name, recursive, mask) )
+	return wd;
+
+    // Note, when a directory that is either already a watch or not is moved into another 
+    // watch, its children come into existence at the same time of its move and we will 
+    // never get a report from it for the existence of any its children although its 
+    // watch (if it is a watch) kicks in immediately on its move, and even if it has any 
+    // subdirectories that are also a watch we will not get any report for its 
+    // grand-children since they are also moved at the same time as it is moved. If it is 
+    // not a watch, we can only set up its watch, no matter how fast we do, after all its 
+    // children have been moved. So, we will get notified of only the top directory in 
+    // this case.
+
+    // When a non-empty directory is copied into a watch together with its children, 
+    // however, we may get notified of the existence of any its children, depending on 
+    // how fast we set up its watch. If some children are already copied before we set up 
+    // the watch, we will miss reports for those children. If it has any grand-children, 
+    // we will get their reports only after we set up a watch for their corresponding 
+    // parent and only for such grand-children that are copied after their parent watch 
+    // kicks in. This is because the inotify watches are basically non-recursive and 
+    // effective only for their immediate children. So, in this case, we may get reports 
+    // for some children and may miss for other children.
+
+    // In case we are IN_MOVED_To'd, we traverse all the subdirectories (but not files) 
+    // and set up their watches recursively and implicitly, without reporting to the 
+    // read().
+    if ( in_move && !recursive )
+	return wd;
+    if ( in_move && parent == Watches::none && setup_threads > 1 ) {
+	traverse_parallel(path, wd);
+	return wd;
+    }
+
+    const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 ) {  // if the directory is gone already,
+	log("Warning: Cannot read \"%s\": %s", path.c_str(), std::strerror(errno));
+	return wd;
+    }
+
+    if ( in_move )  // if we are IN_MOVED_TO'd,
+	// We create a watch for every subdirectory down below, but without reporting it 
+	// to read().
+	traverse(dirfd, wd);
+
+    // If we are IN_CREATEd, we traverse our immediate children (both files and 
+    // subdirectories) and we prepare them to be reported as IN_CREATEd by the read(), 
+    // which may possibly get a duplicate event for some of them from the system but will 
+    // not miss any. We do not recurse into any child subdirectories here because read() 
+    // will do, but a duplicate recurse of read() due to a duplicate event from the 
+    // system will be checked out by the previous "ignored as a duplicate" filtering.
+    else {  // if we are IN_CREATEd,
+	const bool read = for_each_entry(dirfd, [&](const char* name, unsigned char type) {
+	    if ( type == DT_DIR || type == DT_REG || type == DT_LNK ) {
+		// if a directory, a regular file, or a symlink, but not device file, 
+		// fifo, or socket,
+
+		// Make a new IN_CREATE event to be read().
+		const bool isdir = type == DT_DIR;
+		if ( mask & IN_CREATE || isdir && recursive )
+		    synthesize(wd, isdir ? IN_ISDIR | IN_CREATE : IN_CREATE,
+			name, std::strlen(name));
+	    }
+	});
+	if ( !read )
+	    log("Warning: Cannot read \"%s\": %s", path.c_str(), std::strerror(errno));
+    }
+
+    close(dirfd);
+    return wd;  // return wd of only the top directory
+}
+
+template <typename Log>
+void Inotify<Log>::traverse(int dirfd, int wd)
+// Set up watches for all the subdirectories below the directory opened as dirfd, whose 
+// watch is wd, recursively and implicitly without reporting to read().
+// We walk down relative to the open directories using openat(), and set up each watch 
+// through /proc/self/fd/, so that the kernel needs to look up only a single pathname 
+// component for each subdirectory, rather than its full pathname.
+{
+    std::string names;  // names of the subdirectories, each terminated with '\0'
+    const bool read = for_each_entry(dirfd, [&names](const char* name, unsigned char type) {
+	if ( type == DT_DIR )
+	    // We do not follow symlinks to directories (DT_LNK), which may form a loop.
+	    names.append(name, std::strlen(name) + 1);
+    });
+    if ( !read ) {
+	log("Warning: Cannot read \"%s\": %s", path(wd).c_str(), std::strerror(errno));
+	return;
+    }
+
+    const std::string base = fd_path(dirfd);
+    const uint32_t mask = watches.at(wd).mask;
+    for ( const char* name = names.c_str() ; name < names.c_str() + names.size() ;
+	name += std::strlen(name) + 1 ) {
+	bool recursive = true;
+	if ( excluded(watches.slot(watches.at(wd)), name, recursive) )
+	    continue;
+	const int subwd = full() ? (errno = ENOSPC, -1) :
+	    inotify_add_watch(fd, (base + name).c_str(), watch_mask(mask, recursive));
+	if ( subwd == -1 && errno == ENOSPC ) {
+	    // Out of the watches, we poll the rest of the subtree.
+	    if ( !full() )
+		budget.limit = watches.count(false);
+	    add_polled(path(wd)/name, watches.slot(watches.at(wd)), name, recursive, true,
+		mask, true);
+	    continue;
+	}
+	if ( subwd == -1 ) {
+	    blind_spot(path(wd)/name, errno);
+	    continue;
+	}
+	if ( !attach(subwd, watches.slot(watches.at(wd)), name, recursive, mask) ||
+	    !recursive )
+	    continue;
+
+	const int subfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if ( subfd == -1 ) {
+	    const int error = errno;
+	    log("Warning: Cannot read \"%s\": %s", path(subwd).c_str(),
+		std::strerror(error));
+	    continue;
+	}
+	traverse(subfd, subwd);
+	close(subfd);
+    }
+}
+
+template <typename Log>
+void Inotify<Log>::traverse_parallel(const std::string& path, int wd)
+// Set up watches for all the subdirectories below the path, whose watch is wd, using 
+// setup_threads threads.
+// Each thread keeps its own deque of directories to traverse, pushing and popping them 
+// at the back, and steals from the front of the other threads' deques when it runs out 
+// of its own. Calling inotify_add_watch() on the same fd from many threads is safe, but 
+// updating the watches table is not. So, the threads only read the table and collect 
+// what they have added, which is merged into the table afterwards in the order of 
+// parents before children.
+// As traverse() does, the threads walk down relative to the open directories. Each open 
+// directory is shared by its subdirectories in the deques and closed when all of them 
+// are opened, so the number of open directories stays around the depth of the tree 
+// times the number of threads. They also stop adding watches once the budget or kernel 
+// is out of them, and leave the rest to be polled. A thread with nothing to steal 
+// sleeps until another pushes a directory or all are done.
+{
+    using Fd = std::shared_ptr<const int>;
+    struct Dir {  // directory to traverse
+	Fd parent;  // open parent directory, or null if the name is the full pathname
+	std::string name;
+	int wd;
+	std::string path;  // relative to the root, only if there are rules or globs
+    };
+    struct Added {  // watch added by a thread
+	uint64_t seq;  // sequence number that orders every parent before its children
+	int wd, parent;
+	std::string name;
+	bool recursive;
+    };
+    struct Failed { int parent; std::string name; int error; const char* what; };
+    struct alignas(64) Worker {
+	std::mutex lock;  // guards dirs
+	std::deque<Dir> dirs;
+	std::vector<Added> added;
+	std::vector<Failed> failed;
+	uint64_t excluded = 0;
+    };
+    struct alignas(64) Seen { std::mutex lock; std::unordered_set<int> wds; };
+
+    const unsigned n = setup_threads;
+    const std::unique_ptr<Worker[]> workers { new Worker[n] };
+    Seen seen[16];  // wds seen during this traversal, split to lessen lock contention
+    std::atomic<std::size_t> pending { 1 };  // number of directories not traversed yet
+    std::atomic<std::size_t> queued { 1 };  // number of directories in the deques
+    std::atomic<uint64_t> seq { 0 };
+    std::mutex idle_lock;
+    std::condition_variable idle;  // for the threads with nothing to steal
+    std::atomic<std::size_t> watched { watches.count(false) };  // kernel watches in use
+    std::atomic<bool> exhausted { false };  // if kernel or the budget is out of watches
+
+    workers[0].dirs.push_back(Dir { nullptr, path, wd, "" });
+    seen[wd % 16].wds.insert(wd);
+
+    const uint32_t mask = watches.at(wd).mask;  // of the root, for the whole tree
+    const std::string root { watches.name(watches.at(wd)) };
+    const auto found = excludes.find(root);
+    const Excludes* const rules = found != excludes.end() ? &found->second : nullptr;
+    const auto planned = includes.find(root);
+    const Includes* const plan = planned != includes.end() ? &planned->second : nullptr;
+    const auto done = [&] {  // Wake up the idle threads if all directories are done.
+	if ( --pending == 0 ) {
+	    std::lock_guard<std::mutex> guard(idle_lock);
+	    idle.notify_all();
+	}
+    };
+    const auto work = [&](unsigned id) {
+	Worker& self = workers[id];
+	while ( pending.load() > 0 ) {
+	    Dir dir;
+	    bool found = false;
+	    for ( unsigned i = 0 ; !found && i < n ; ++i ) {
+		Worker& victim = workers[(id + i) % n];  // will be self first.
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if ( !victim.dirs.empty() ) {
+		    if ( i == 0 ) {
+			dir = std::move(victim.dirs.back());
+			victim.dirs.pop_back();
+		    } else {
+			dir = std::move(victim.dirs.front());
+			victim.dirs.pop_front();
+		    }
+		    found = true;
+		}
+	    }
+	    if ( !found ) {  // if other threads are still traversing,
+		std::unique_lock<std::mutex> guard(idle_lock);
+		idle.wait(guard, [&] { return pending.load() == 0 || queued.load() > 0; });
+		continue;
+	    }
+	    --queued;
+
+	    const int dirfd = dir.parent ?
+		openat(*dir.parent, dir.name.c_str(),
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) :
+		open(dir.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	    dir.parent.reset();
+	    std::string names;  // names of the subdirectories, each terminated with '\0'
+	    if ( dirfd == -1 ||
+		!for_each_entry(dirfd, [&names](const char* name, unsigned char type) {
+		    if ( type == DT_DIR )
+			names.append(name, std::strlen(name) + 1);
+		}) ) {
+		self.failed.push_back(Failed { dir.wd, "", errno, "read" });
+		if ( dirfd != -1 )
+		    close(dirfd);
+		done();
+		continue;
+	    }
+
+	    const Fd parent { new int(dirfd), [](const int* fd) { close(*fd); delete fd; } };
+	    const std::string base = fd_path(dirfd);
+	    for ( const char* name = names.c_str() ; name < names.c_str() + names.size() ;
+		name += std::strlen(name) + 1 ) {
+		std::string path = rules || plan ? dir.path/name : std::string();
+		const typename Includes::Fit fit = plan ? plan->fit(path) : Includes::inner;
+		if ( fit == Includes::none || (rules && rules->match(path)) ) {
+		    ++self.excluded;
+		    continue;
+		}
+		const bool recursive = fit == Includes::inner;
+		// A watch is reserved from the budget before added, and given back if it 
+		// turns out to be a duplicate.
+		const bool full = exhausted.load() ||
+		    (budget.limit && watched.fetch_add(1) >= budget.limit);
+		const int wd = full ? (errno = ENOSPC, -1) :
+		    inotify_add_watch(fd, (base + name).c_str(), watch_mask(mask, recursive));
+		if ( wd == -1 ) {
+		    const int error = errno;
+		    if ( budget.limit && !exhausted.load() )
+			--watched;
+		    if ( error == ENOSPC )
+			exhausted.store(true);  // The rest below will be polled.
+		    self.failed.push_back(Failed { dir.wd, name, error, "watch" });
+		    continue;
+		}
+
+		// We do not traverse an existing recursive watch again, as attach() does 
+		// not, nor any directory that is seen more than once such as through a 
+		// bind mount.
+		const Watch* const watch = watches.find(wd);
+		bool traverse = !watch || !watch->recursive;
+		if ( traverse ) {
+		    Seen& bucket = seen[wd % 16];
+		    std::lock_guard<std::mutex> guard(bucket.lock);
+		    traverse = bucket.wds.insert(wd).second;
+		}
+		if ( (watch || !traverse) && budget.limit )
+		    --watched;  // not a new watch
+
+		self.added.push_back(Added { seq++, wd, dir.wd, name, recursive });
+		if ( traverse && recursive ) {
+		    ++pending;
+		    {
+			std::lock_guard<std::mutex> guard(self.lock);
+			self.dirs.push_back(Dir { parent, name, wd, std::move(path) });
+		    }
+		    ++queued;
+		    std::lock_guard<std::mutex> guard(idle_lock);
+		    idle.notify_one();
+		}
+	    }
+	    done();
+	}
+    };
+
+    std::vector<std::thread> threads;
+    for ( unsigned id = 1 ; id < n ; ++id )
+	threads.emplace_back(work, id);
+    work(0);
+    for ( std::thread& thread: threads )
+	thread.join();
+
+    std::vector<Added*> added;
+    for ( unsigned id = 0 ; id < n ; ++id )
+	for ( Added& it: workers[id].added )
+	    added.push_back(&it);
+    std::sort(added.begin(), added.end(),
+	[](const Added* a, const Added* b) { return a->seq < b->seq; });
+
+    for ( const Added* it: added )
+	if ( const Watch* const parent = watches.find(it->parent) )
+	    attach(it->wd, watches.slot(*parent), it->name, it->recursive, mask);
+    for ( unsigned id = 0 ; id < n ; ++id )
+	statistics.excluded += workers[id].excluded;
+
+    for ( unsigned id = 0 ; id < n ; ++id )
+	for ( const Failed& it: workers[id].failed ) {
+	    const Watch* const parent = watches.find(it.parent);
+	    const std::string path = parent ? this->path(it.parent)/it.name.c_str() :
+		it.name;
+	    if ( *it.what == 'w' && it.error == ENOSPC && parent ) {
+		// Out of the watches, we poll the rest of the subtree.
+		if ( !budget.limit || budget.limit > watches.count(false) )
+		    budget.limit = watches.count(false);
+		add_polled(path, watches.slot(*parent), it.name, true, true, mask, true);
+	    }
+	    else if ( *it.what == 'w' )
+		blind_spot(path, it.error);
+	    else
+		log("Warning: Cannot %s \"%s\": %s", it.what, path.c_str(),
+		    std::strerror(it.error));
+	}
+}
+
+template <typename Log>
+void Inotify<Log>::rm_watch(int wd, bool subtree) noexcept
+// Remove the watch associated with wd, and then IN_IGNORED event will be generated for 
+// this wd. If subtree is set, remove also all the watches below it, from the bottom up.
+{
+    if ( const Watch* watch = subtree ? watches.find(wd) : nullptr )
+	watches.for_each_in_subtree(watches.slot(*watch),
+	    [this](const Watch& watch) { rm_watch(watch.wd); });
+    else if ( wd < -1 ) {
+	// A polled watch gets its IN_IGNORED event from us, and is polled no more.
+	if ( polls.erase(wd) )
+	    synthesize(wd, IN_IGNORED, "", 0);
+    }
+    else if ( inotify_rm_watch(fd, wd) )  // == -1
+	log("Warning: inotify_rm_watch():%d - %s", errno, std::strerror(errno));
+}
+
+template <typename Log>
+bool Inotify<Log>::rm_pending(const std::string& path) noexcept
+// Give up the root watch kept pending for the path given to add_watch(), or return false 
+// if none is pending (any longer).
+{
+    std::string_view name = path;
+    while ( name.size() > 1 && name.back() == '/' )
+	name.remove_suffix(1);
+    for ( auto it = pending.begin() ; it != pending.end() ; ++it )
+	if ( it->path == name ) {
+	    const int wd = it->wd;
+	    log("Info: %s no longer pending", it->path.c_str());
+	    pending.erase(it);
+	    release(wd);
+	    return true;
+	}
+    return false;
+}
+
+template <typename Log>
+void Inotify<Log>::rm_all_watches() noexcept
+// Delete all watches, and the pending ones as well.
+// Unlike ~Inotify(), we can continue to use .add_watch() and .read().
+{
+    for ( const Pending& it: std::exchange(pending, {}) )
+	release(it.wd);
+    watches.for_each([this](const Watch& watch) { rm_watch(watch.wd); });
+}
+
+template <typename Log>
+void Inotify<Log>::rewatch(uint32_t slot)
+// Tell kernel the mask of the watch at slot, as it has changed. A polled watch just takes 
+// it at the next poll.
+{
+    const Watch& watch = watches[slot];
+    if ( watch.wd < 0 )
+	return;
+    const std::string path = this->path(watch.wd);
+    const int wd = inotify_add_watch(fd, path.c_str(),
+	watch_mask(watch.mask, watch.recursive) |
+	(waited_on(watch.wd) ? pending_mask & ~IN_MASK_ADD : 0));
+    if ( wd == -1 )
+	log("Warning: Cannot watch \"%s\": %s", path.c_str(), std::strerror(errno));
+    else if ( wd != watch.wd && !watches.find(wd) )
+	inotify_rm_watch(fd, wd);  // The path is another directory now.
+}
+
+template <typename Log>
+void Inotify<Log>::set_mask(int wd, uint32_t mask, bool subtree)
+// Change the events of interest for the watch of wd, and for all the watches below it if 
+// subtree is set, which the subdirectories to come will inherit. Kernel is told the new 
+// mask for each watch changed, so that it stops queueing the events of no interest.
+{
+    const auto apply = [this, mask](const Watch& found) {
+	const uint32_t slot = watches.slot(found);
+	uint32_t kernel = mask;
+	if ( !files.empty() )
+	    if ( const auto it = files.find(slot) ; it != files.end() ) {
+		it->second.own = mask;
+		kernel |= it->second.mask;  // for the files in it too
+	    }
+	if ( watches[slot].mask != kernel ) {
+	    watches[slot].mask = kernel;
+	    rewatch(slot);
+	}
+    };
+    if ( const Watch* const watch = watches.find(wd) ) {
+	if ( subtree )
+	    watches.for_each_in_subtree(watches.slot(*watch), apply);
+	else
+	    apply(*watch);
+    }
+}
+
+template <typename Log>
+const inotify_event* Inotify<Log>::read(int timeout, int read_delay)
+// Read one inotify event from fd, or return nullptr if timed out or cancelled by 
+// cancel().
+// Will throw an exception when an error is returned from poll() or read().
+
+// The read_delay: The time in milliseconds to wait after the first event arrives before 
+// reading the buffer. This allows further events to accumulate before reading, which 
+// allows the kernel to consolidate like events and can enhance performance when there 
+// are many similar events. The delay ends early if the kernel queue is getting full (see 
+// delay_threshold), or if cancelled. It does not run over the timeout either. It is 
+// ignored if adaptive_delay() is set.
+// If no watches are set up, read() will still run ok and will wait for nothing.
+// If kernel reports IN_Q_OVERFLOW (with wd of -1), it is returned regardless of the mask 
+// after we recover from it (see recover()).
+// So is the IN_CREATE | IN_ISDIR event for a pending root that has come (see pend()).
+{
+    reader.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    created.reclaim();
+    if ( const inotify_event* event = next() )
+	// If some events are left from the last wakeup, we do not need to wait nor even 
+	// to check the time.
+	return event;
+
+    const auto then = std::chrono::steady_clock::now();  // check starting time
+    for ( int time_left = timeout ; ; ) {
+	if ( !wait(time_left, read_delay) )
+	    return nullptr;  // timed out or cancelled!
+	if ( const inotify_event* event = next() )
+	    return event;
+
+	// So far, We got some events and handled all of them, but we could not report 
+	// any events of interest to the caller. We will take another oppertunity to read 
+	// more events only if we have enough time left though, or report nothing 
+	// otherwise.
+	if ( timeout >= 0 /* != -1 */ ) {
+	    time_left = timeout - std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - then).count();
+	    if ( time_left <= 0 )
+		return nullptr;  // timed out!
+	}
+    }
+}
+
+template <typename Log>
+template <typename Container>
+std::size_t Inotify<Log>::read_batch(Container& events, std::size_t max, int timeout,
+    int read_delay)
+// Append every event that is ready at a single wakeup to events (using push_back()), up 
+// to max events, and return the number of them appended, or 0 if timed out.
+// We wait for the first event as read() does, but not for the rest.
+// The events appended remain valid until the next call to read(), read_batch(), or 
+// events(). But the events after each of them have been handled as well by then, which 
+// may have removed or moved its watch, so path() may throw or tell where it is now 
+// rather than where the event was. If events takes Events instead of pointers, such as 
+// a vector<Event>, each is appended resolved with its pathname as it is handled, as 
+// drain() does.
+{
+    std::size_t count = 0;
+    if ( max > 0 )
+	for ( const inotify_event* event = read(timeout, read_delay) ; event ;
+	    event = next() ) {
+	    append(events, event);
+	    if ( ++count == max )
+		break;
+	}
+    return count;
+}
+
+template <typename Log>
+template <typename Container>
+std::size_t Inotify<Log>::try_read_batch(Container& events, std::size_t max)
+// Append the events that are ready to events as read_batch() does, but without waiting 
+// at all, or return 0 with errno set to EAGAIN if no events are ready.
+{
+    std::size_t count = 0;
+    if ( max > 0 )
+	for ( const inotify_event* event = try_read() ; event ; event = next() ) {
+	    append(events, event);
+	    if ( ++count == max )
+		break;
+	}
+    return count;
+}
+
+template <typename Log>
+bool Inotify<Log>::wait(int timeout, int read_delay)
+// Wait for events and read them into the buffer, or return false if timed out or 
+// cancelled. It also returns true with no events read if it has run commands posted.
+// Should be called only when all the events in the buffer and all the synthetic events 
+// have been handled.
+{
+    const auto then = std::chrono::steady_clock::now();
+    const char* where;
+
+    int wait_time = timeout;
+    bool polling = false;  // if waiting only until the next directory to poll is due
+    rebudget();
+    if ( !polls.empty() ) {
+	const int due = poll_due();
+	if ( due >= 0 && (timeout < 0 || due < timeout) ) {
+	    wait_time = due;
+	    polling = true;
+	}
+    }
+    if ( !created.empty() )
+	return true;  // with the events made up by polling or promoting
+
+    where = "poll()";
+    switch ( poll(fds, 3, wait_time) ) {
+	case 0:  // timed out, or time to poll!
+	    return polling;
+
+	default:  // or, events are ready, commands are posted, or we are cancelled!
+	    if ( fds[1].revents & POLLIN )
+		return !uncancel(fds[1].fd);
+	    if ( fds[2].revents & POLLIN ) {
+		uncancel(command_fd);
+		run_commands();
+		return true;
+	    }
+
+	    if ( adaptive.max_delay )
+		read_delay = statistics.delay;
+	    if ( read_delay > 0 && timeout >= 0 )
+		// The delay should not run over the timeout.
+		read_delay = std::min<long>(read_delay, timeout -
+		    std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - then).count());
+	    where = "linger()";
+	    if ( read_delay <= 0 || linger(read_delay) ) {
+		if ( fill(where) )
+		    return true;
+	    }
+	    else if ( errno == ECANCELED )
+		return false;
+	    // intentional fall-through
+
+	case -1:  // error in system call
+	    log("Error: %s:%d - %s", where, errno, std::strerror(errno));
+	    throw std::system_error(errno, std::system_category());
+    }
+}
+
+template <typename Log>
+bool Inotify<Log>::fill(const char*& where)
+// Read the events pending in kernel into the buffer without waiting, or return false 
+// with errno set (to EAGAIN if none are pending) and where set to the call failed.
+{
+    where = "ioctl()";
+    if ( max_buffer_size != min_buffer_size && !resize_buffer() )
+	return false;
+
+    where = "read()";
+    const std::time_t now = std::time(nullptr);
+    bytes_in_buffer = ::read(fd, buffer.get(), buffer_size);
+    if ( bytes_in_buffer > 0 ) {
+	if ( bytes_in_buffer + min_event_size <= buffer_size )
+	    // Kernel would have filled the buffer up more if any more events were queued, 
+	    // so we have read all of them.
+	    drained_at = now;
+	++statistics.reads;
+	statistics.bytes_read += bytes_in_buffer;
+	adapt_delay();
+	if ( !rejects.empty() )
+	    // They are dropped all at once before we look up any of their watches.
+	    statistics.rejected += rejects.sweep(buffer.get(), bytes_in_buffer);
+	return true;
+    }
+    if ( bytes_in_buffer == 0 )
+	// EOF reached. Possibly too many events occurred at once?
+	errno = EIO;
+    bytes_in_buffer = 0;
+    return false;
+}
+
+template <typename Log>
+const inotify_event* Inotify<Log>::try_read()
+// Read one inotify event as read() does, but without waiting at all, or return nullptr 
+// with errno set to EAGAIN if no events are ready. The read_delay does not apply here.
+// This is to serve inotify from an external event loop, such as epoll, watching 
+// native_handle() (and wake_handle() for post()). Once either is ready, call try_read() 
+// until it returns nullptr, by which time we have read kernel up to EAGAIN, so that it 
+// works with edge-triggered epoll as well. If any watch is polled, call it also when 
+// next_poll() has passed.
+// Will throw an exception when an error other than EAGAIN is returned from read().
+{
+    reader.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    created.reclaim();
+    for (;;) {
+	if ( const inotify_event* event = next() )
+	    return event;
+
+	uint64_t count;
+	if ( ::read(command_fd, &count, sizeof(count)) > 0 ) {
+	    run_commands();
+	    continue;  // The commands may have made up some events.
+	}
+	rebudget();
+	if ( !polls.empty() )
+	    poll_due();
+	if ( !created.empty() )
+	    continue;
+
+	const char* where;
+	if ( !fill(where) ) {
+	    if ( errno == EAGAIN )
+		return nullptr;
+	    log("Error: %s:%d - %s", where, errno, std::strerror(errno));
+	    throw std::system_error(errno, std::system_category());
+	}
+    }
+}
+
+template <typename Log>
+void Inotify<Log>::adapt_delay() noexcept
+// Count the events just read, and choose the read_delay for the next read from the rate 
+// of events and the depth of the kernel queue, if adaptive.
+// The rate is taken over the time between reads, which includes the delay itself, so 
+// that a longer delay does not look like a heavier load. We cannot tell how many events 
+// kernel has merged, but more events per read means fewer wakeups and more chances for 
+// kernel to merge the like ones that come in a row. But if the bytes still pending in 
+// kernel after the read reach half the delay_threshold, the queue is backing up faster 
+// than we drain it, so the delay is cut regardless of the rate not to overflow it.
+{
+    int count = 0;
+    for ( int i = 0 ; i < bytes_in_buffer ; ++count )
+	i += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(&buffer[i])->len;
+    statistics.events_read += count;
+
+    if ( !adaptive.max_delay )
+	return;
+    const auto now = std::chrono::steady_clock::now();
+    const double interval = std::max(0.001,  // at least 1 ms not to blow up the rate
+	std::chrono::duration<double>(now - adaptive.last_read).count());
+    adaptive.last_read = now;
+    const double weight = interval / (interval + 0.1);  // averaged over about 100 ms
+    adaptive.rate += weight * (count / interval - adaptive.rate);
+
+    int queued;  // bytes left pending in kernel
+    if ( ioctl(fd, FIONREAD, &queued) == -1 )
+	queued = 0;
+    int& delay = statistics.delay;
+    if ( std::size_t(queued) >= delay_threshold / 2 )
+	delay /= 2;
+    else if ( adaptive.rate >= adaptive.busy_rate )
+	delay = std::min(adaptive.max_delay, std::max(1, delay * 2));
+    else
+	delay /= 2;
+}
+
+template <typename Log>
+template <typename F>
+auto Inotify<Log>::post(F f) -> std::future<std::invoke_result_t<F, Inotify&>>
+// Post a command f(*this) to be run by the thread in read() (or by the drain thread), and 
+// return the future of its result, such as:
+//     inotify.post([path](auto& inotify) { return inotify.add_watch(path); }).get();
+// It can be called from any thread, while read() is blocked in another thread, which 
+// wakes up at once to run the command and then goes back to wait. The command can call 
+// any member functions, such as add_watch(), rm_watch(), path(), and stats(), as it is 
+// run by the reader itself.
+// Posted from the reader itself, such as from within a command or between reads, the 
+// command is run at once before returning, since waiting for the future would otherwise 
+// wait for the reader to come back to read(), which is never.
+{
+    using R = std::invoke_result_t<F, Inotify&>;
+    const auto task =
+	std::make_shared<std::packaged_task<R()>>([this, f = std::move(f)]() mutable {
+	    return f(*this);
+	});
+    std::future<R> result = task->get_future();
+    if ( reader.load(std::memory_order_relaxed) == std::this_thread::get_id() ) {
+	(*task)();
+	return result;
+    }
+    {
+	std::lock_guard<std::mutex> lock { commands_mutex };
+	commands.emplace_back([task] { (*task)(); });
+    }
+    signal(command_fd);
+    return result;
+}
+
+template <typename Log>
+void Inotify<Log>::run_commands()
+// Run the commands posted so far. Their exceptions are passed through their futures.
+{
+    std::vector<std::function<void()>> ready;
+    {
+	std::lock_guard<std::mutex> lock { commands_mutex };
+	ready.swap(commands);
+    }
+    for ( const auto& command: ready )
+	command();
+}
+
+template <typename Log>
+bool Inotify<Log>::linger(int read_delay)
+// Wait for read_delay milliseconds for more events to accumulate in kernel, but stop 
+// early once delay_threshold bytes are pending, or, if the buffer can grow, once more 
+// bytes are pending than it can grow to, since waiting longer cannot make the next read 
+// any fuller. (A fixed buffer is read over and over anyway, so is no reason to stop.)
+// Return false with errno set to ECANCELED if cancelled, or to others if poll() or 
+// ioctl() fails.
+// We sleep in poll() on the wake_fd only, so that cancel() can wake us up at once, and 
+// check the pending bytes in slices of the delay, since kernel does not tell us when 
+// they cross the threshold.
+{
+    const auto deadline =
+	std::chrono::steady_clock::now() + std::chrono::milliseconds(read_delay);
+    const int slice = std::max(1, read_delay / 8);
+
+    for (;;) {
+	int pending;
+	if ( ioctl(fd, FIONREAD, &pending) == -1 )
+	    return false;
+	if ( std::size_t(pending) >= delay_threshold ||
+	    (max_buffer_size != min_buffer_size && std::size_t(pending) >= max_buffer_size) )
+	    return true;  // The queue is getting full, so no more delay.
+
+	const int time_left = std::chrono::ceil<std::chrono::milliseconds>(
+	    deadline - std::chrono::steady_clock::now()).count();
+	if ( time_left <= 0 )
+	    return true;
+
+	switch ( poll(&fds[1], 1, std::min(time_left, slice)) ) {
+	    case 0:
+		break;
+	    case -1:
+		return false;
+	    default:  // cancelled!
+		uncancel(fds[1].fd);
+		errno = ECANCELED;
+		return false;
+	}
+    }
+}
+
+template <typename Log>
+bool Inotify<Log>::resize_buffer()
+// Resize the buffer to the power-of-2 multiple of min_buffer_size that fits all the 
+// bytes pending in kernel, but not over max_buffer_size. It grows at once, but shrinks 
+// only if it is much larger than needed, so as not to reallocate it every time.
+// Return false with errno set if ioctl() fails.
+{
+    int pending;
+    if ( ioctl(fd, FIONREAD, &pending) == -1 )
+	return false;
+
+    std::size_t size = min_buffer_size;
+    while ( size < std::size_t(pending) && size < max_buffer_size )
+	size *= 2;
+    size = std::min(size, max_buffer_size);
+
+    if ( size > buffer_size || size*4 <= buffer_size ) {
+	printf("buffer resized to %zu bytes for %d bytes pending\n", size, pending);
+	buffer.reset();  // frees the old buffer first.
+	buffer.reset(new char[size]);
+	buffer_size = size;
+    }
+    return true;
+}
+
+template <typename Log>
+const inotify_event* Inotify<Log>::next()
+// Handle the events in the buffer and then the synthetic events, in order, and return 
+// the first one of interest to the caller, or nullptr if all of them are handled 
+// without any of interest. It never waits.
+{
+    // Repeat until all bytes in the buffer and all synthetic events are handled.
+    while ( bytes_in_buffer > 0 || !created.empty() ) {
+	const bool synthetic = bytes_in_buffer == 0;
+	const inotify_event& event = synthetic ? created.pop() :
+	    *(inotify_event*)(buffer.get() + bytes_handled);
+
+	if ( !synthetic ) {
+	    bytes_handled += sizeof(inotify_event) + event.len;
+	    if ( bytes_handled >= bytes_in_buffer ) {
+		if ( bytes_handled > bytes_in_buffer ) {  // sanity check
+		    // An incomplete event was read from read(). This is not to happen, 
+		    // but we just report the same failure that read() would do in case 
+		    // the buffer is too small to hold an event.
+		    log("Error: read() - Incomplete event returned");
+		    throw std::system_error(EINVAL, std::system_category());
+		}
+		bytes_handled = bytes_in_buffer = 0;
+	    }
+	}
+	if ( event.mask == 0 )
+	    continue;  // rejected by its name
+
+	if ( event.mask & IN_Q_OVERFLOW ) {
+	    log("Warning: read() - IN_Q_OVERFLOW, rescanning the directories changed");
+	    recover();
+	    return &event;
+	}
+
+	if ( !pending.empty() && !synthetic && follow(event) && !watches.find(event.wd) )
+	    continue;  // for an ancestor of pending watches only
+
+	const Watch* watch = watches.find(event.wd);
+	if ( !watch && !synthetic && !budget.aliases.empty() ) {
+	    const auto alias = budget.aliases.find(event.wd);
+	    if ( alias != budget.aliases.end() ) {
+		// The event was queued in kernel before the watch was demoted, and is now 
+		// for its polled watch, except IN_IGNORED for the kernel watch removed.
+		if ( event.mask & IN_IGNORED ) {
+		    budget.aliases.erase(alias);
+		    continue;
+		}
+		const_cast<inotify_event&>(event).wd = alias->second;  // in our buffer
+		watch = watches.find(event.wd);
+	    }
+	}
+	if ( !watch && synthetic )
+	    // The directory of a synthetic event can be deleted (with IN_IGNORED) before 
+	    // the event is read out, in which case the event is stale.
+	    continue;
+	if ( !watch ) {
+	    // A watch that recover() found gone is erased before its own events arrive.
+	    printf("Event for unknown wd [%d] (%#x)\n", event.wd, event.mask);
+	    continue;
+	}
+	const uint32_t slot = watches.slot(*watch);
+	    // We keep the slot rather than the reference to the watch, since the 
+	    // reference can be invalidated by add_watch() below.
+	watches[slot].heat += 1;
+	uint32_t mask = watches[slot].mask;  // of interest, even after erased below
+	uint32_t interest = mask;  // for this event
+	if ( !files.empty() )
+	    if ( const auto it = files.find(slot) ; it != files.end() ) {
+		// A directory watched for its files reports the events of its own, and of 
+		// those files only by their own masks, which its subdirectories do not 
+		// inherit.
+		interest = mask = it->second.own;
+		if ( !mask )
+		    interest = IN_DELETE_SELF | IN_IGNORED;  // which end the files
+		if ( event.len && *event.name ) {
+#if __cpp_lib_generic_unordered_lookup
+		    const auto file = it->second.masks.find(std::string_view(event.name));
+#else
+		    const auto file = it->second.masks.find(file_name.assign(event.name));
+#endif
+		    if ( file != it->second.masks.end() )
+			interest |= file->second;
+		}
+	    }
+	printf("- [%d] %s (%#x)\n", event.wd,
+	    (event.len ? path(event.wd)/event.name : path(event.wd)).c_str(), event.mask);
+
+	// A new subdirectory was created or moved in.
+	if ( event.mask & (IN_CREATE | IN_MOVED_TO) &&
+	    event.mask & IN_ISDIR &&
+	    watch->recursive &&
+	    event.len && *event.name ) {  // but not a pending root that has come
+	    const bool in_move = event.mask & IN_MOVED_TO;  // will cast to 0 or 1.
+	    const int wd = add_watch(path(event.wd)/event.name, slot, event.name,
+		true, in_move, mask);
+	    // The event.name here will be non-empty for IN_CREATE and IN_MOVED_TO.
+	    // When a watch is moved into another directory, the watch is retained only 
 	    // if that directory is also a watch and recursive, or deleted otherwise (at 
 	    // the next IN_MOVE_SELF event). And, even if the watch was not recursive, it 
 	    // turns into a recursive one and all its subdirectories as well. This way, 
@@ -385,7 +2963,7 @@ const inotify_event* Inotify<Log>::read(int timeout, int read_delay)
 	    // the same watch in this case for efficiency reasons, and we just mark this 
 	    // recycle on the in-struct in_move flag. If a watch is marked with this 
 	    // recycle, it will survive the next IN_MOVE_SELF and will not be deleted.
-	    if ( in_move && wd >= 0 /* != -1 */ )
+	    if ( in_move && wd != -1 )
 		watches.at(wd).in_move = true;
 		// In case of in_move, we here mark only the top directory of the moved 
 		// tree as in_move, because the IN_MOVED_TO event and the corresponding 
@@ -397,51 +2975,796 @@ const inotify_event* Inotify<Log>::read(int timeout, int read_delay)
 	if ( event.mask & IN_MOVE_SELF ) {
 	    // We do not need to check here if it is a directory because only directory 
 	    // watches were allowed.
-	    if ( watch.in_move )
+	    if ( watches[slot].in_move )
 		// Do not delete if marked as in_move.
-		watch.in_move = false;
-
-	    else if ( watch.path.back() == '/' )
-		rm_watch(event.wd);
+		watches[slot].in_move = false;
 
 	    else
 		// We recursively delete this MOVE_SELF'd watch and all the watches for 
-		// its subdirectories (whether or not they are recursive watches).
-		for ( const auto& it: watches )
-		    if ( it.second.path.compare(0, watch.path.size(), watch.path) == 0 )
-			// checks if it.second.path starts with watch_path. Even if 
-			// it.second.path is a prefix of watch.path on the other hand, it 
-			// will be handled ok and compare() will yield non-zero.
-			rm_watch(it.first);
-		    // We do not actually remove members from the watches map here, which 
-		    // will be done at the IN_IGNORED event later. That is why we could 
-		    // declare watch.path to be a string reference rather than a copy of 
-		    // string.
+		// its subdirectories (whether or not they are recursive watches), walking 
+		// only down its own subtree.
+		watches.for_each_in_subtree(slot,
+		    [this](const Watch& watch) { rm_watch(watch.wd); });
+		// We do not actually remove members from the watches table here, which 
+		// will be done at the IN_IGNORED event later. The watches are removed in 
+		// post-order, so their IN_IGNORED events will also arrive from the bottom 
+		// up.
 	}
 
 	// A watch was deleted implicitly, so delete it from the dictionary too.
 	if ( event.mask & IN_IGNORED ) {
-	    printf("[%d] %s deleted\n", event.wd, watch.path.c_str());
-	    watches.erase(event.wd);
+	    printf("[%d] %s deleted\n", event.wd, path(event.wd).c_str());
+	    erase(watches[slot]);
 	}
 
 	// If a matching event is found, return it.
-	if ( event.mask & mask )
+	if ( event.mask & interest && (!event.len || !*event.name || included(slot, event.name)) )
 	    return &event;
+	if ( synthetic && event.mask & IN_CREATE && !*event.name )
+	    return &event;  // for a pending root that has come
+    }
+
+    return nullptr;
+}
+
+template <typename Log>
+void Inotify<Log>::recover()
+// Recover from IN_Q_OVERFLOW, after which kernel has dropped events until we drain the 
+// queue.
+// We do not set up all the watches again, but walk the watches we have, and read only 
+// the directories changed since drained_at, when we last read all the events. In them, 
+// we make up IN_CREATE events for the subdirectories we do not know and for the files 
+// changed, and IN_DELETE events for the subdirectories gone, so that read() will see 
+// the differences as if the events were not dropped. We cannot know the files deleted 
+// though, since we keep no record of files.
+// The status change time (ctime) is used rather than the modification time, since it 
+// also changes with the modification time and cannot be set back by the user. A slack 
+// of 1 second is taken for the timestamp granularity of filesystems.
+{
+    ++statistics.overflows;
+    const std::time_t since = drained_at - 1;
+
+    std::vector<uint32_t> roots;
+    watches.for_each([this, &roots](const Watch& watch) {
+	if ( watch.parent == Watches::none && watch.wd >= 0 )  // Polling has no queue.
+	    roots.push_back(watches.slot(watch));
+    });
+    for ( const uint32_t slot: roots ) {
+	const std::string path { watches.name(watches[slot]) };
+	const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ( dirfd == -1 ) {
+	    // The root is gone, and its IN_IGNORED might have been dropped too.
+	    const int error = errno;  // log() may clobber it.
+	    log("Warning: Cannot read \"%s\": %s", path.c_str(), std::strerror(error));
+	    if ( error == ENOENT || error == ENOTDIR )
+		remove(slot);
+	    continue;
+	}
+	rescan(dirfd, slot, since, false);
+	close(dirfd);
+    }
+
+    // The pending watches may have missed the paths coming too.
+    if ( !pending.empty() )
+	repend(std::exchange(pending, {}));
+}
+
+template <typename Log>
+void Inotify<Log>::rescan(int dirfd, uint32_t slot, std::time_t since, bool changed)
+// Rescan the directory opened as dirfd, whose watch is at slot, and all the directories 
+// of the watches below it, as recover() does. The changed tells if its parent directory 
+// has changed, in which case it may have been replaced with another directory of the 
+// same name.
+// The polled watches below, which have lost no events, are not rescanned but left to 
+// their polls, which tell what has changed in them by themselves, so that they do not 
+// take kernel watches here.
+{
+    const int wd = watches[slot].wd;
+    const bool recursive = watches[slot].recursive;
+    const uint32_t mask = watches[slot].mask;
+
+    if ( changed ) {
+	// We check that the directory is still the one watched, where kernel gives us the 
+	// same wd again for the same inode.
+	const int newwd =
+	    inotify_add_watch(fd, fd_path(dirfd).c_str(), watch_mask(mask, recursive));
+	if ( newwd != wd ) {
+	    const Watch& watch = watches[slot];
+	    const int parentwd = watches[watch.parent].wd;
+	    const std::string name { watches.name(watch) };
+	    synthesize(parentwd, IN_ISDIR | IN_DELETE, name.c_str(), name.size());
+	    remove(slot);
+	    synthesize(parentwd, IN_ISDIR | IN_CREATE, name.c_str(), name.size());
+	    return;
+	}
+    }
+
+    struct stat st;
+    changed = fstat(dirfd, &st) == 0 && st.st_ctime >= since;
+    if ( changed ) {
+	std::unordered_map<std::string_view, uint32_t> gone;
+	    // children not found in the directory so far, by name
+	for ( uint32_t child = watches[slot].first_child ; child != Watches::none ;
+	    child = watches[child].next_sibling )
+	    gone.emplace(watches.name(watches[child]), child);
+
+	const bool read = for_each_entry(dirfd, [&](const char* name, unsigned char type) {
+	    const std::size_t size = std::strlen(name);
+	    if ( type == DT_DIR ) {
+		if ( gone.erase(std::string_view(name, size)) == 0 &&
+		    (mask & IN_CREATE || recursive) )
+		    synthesize(wd, IN_ISDIR | IN_CREATE, name, size);
+	    }
+	    else if ( (type == DT_REG || type == DT_LNK) && mask & IN_CREATE ) {
+		struct stat st;
+		if ( fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    st.st_ctime >= since )
+		    synthesize(wd, IN_CREATE, name, size);
+	    }
+	});
+	if ( !read ) {
+	    log("Warning: Cannot read \"%s\": %s", path(wd).c_str(), std::strerror(errno));
+	    return;
+	}
+
+	for ( const auto& [name, child]: gone ) {
+	    synthesize(wd, IN_ISDIR | IN_DELETE, name.data(), name.size());
+	    remove(child);
+	}
+    }
+
+    for ( uint32_t child = watches[slot].first_child ; child != Watches::none ; ) {
+	const uint32_t next = watches[child].next_sibling;  // child may be removed below.
+	if ( watches[child].wd < 0 ) {
+	    child = next;
+	    continue;  // polled
+	}
+	const std::string name { watches.name(watches[child]) };
+	const int subfd =
+	    openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if ( subfd != -1 ) {
+	    rescan(subfd, child, since, changed);
+	    close(subfd);
+	}
+	else if ( errno == ENOENT || errno == ENOTDIR || errno == ELOOP ) {
+	    // It has just gone, after we read the directory (or without changing it).
+	    synthesize(wd, IN_ISDIR | IN_DELETE, name.c_str(), name.size());
+	    remove(child);
+	}
+	else
+	    log("Warning: Cannot read \"%s\": %s", (path(wd)/name.c_str()).c_str(),
+		std::strerror(errno));
+	child = next;
+    }
+}
 
-    // Repeat until all bytes in the buffer are handled.
-    } while ( bytes_handled > 0 );
+template <typename Log>
+void Inotify<Log>::remove(uint32_t slot) noexcept
+// Remove the watch at slot and all the watches below it, both from kernel and from the 
+// dictionary, without waiting for their IN_IGNORED events, which may have been dropped.
+// Any IN_IGNORED events that still come for them will be skipped as unknown wds.
+{
+    std::vector<int> wds;
+    watches.for_each_in_subtree(slot, [&wds](const Watch& watch) { wds.push_back(watch.wd); });
+    for ( const int wd: wds ) {  // from the bottom up
+	inotify_rm_watch(fd, wd);  // which fails if kernel has removed it already.
+	erase(watches.at(wd));
+    }
+}
+
+template <typename Log>
+void Inotify<Log>::synthesize(int wd, uint32_t mask, const char* name, std::size_t size,
+    uint32_t cookie)
+// Make up an event for wd with the name of size bytes, to be read() after the events in 
+// the buffer, unless the name is rejected.
+{
+    if ( !(mask & IN_ISDIR) && !rejects.empty() && rejects.match(name, size) ) {
+	++statistics.rejected;
+	return;
+    }
+    const uint32_t len = (size+sizeof(int))/sizeof(int)*sizeof(int);
+	// length including '\0' that fits in word boundary
+    inotify_event& event = created.push(len);
+    event.wd = wd;
+    event.mask = mask;
+    event.cookie = cookie;
+    std::memcpy(event.name, name, size);
+    std::memset(event.name + size, '\0', len - size);
+}
+
+template <typename Log>
+void Inotify<Log>::poll_mount(const std::string& path, bool polled)
+// Poll (or never poll) the watches to be added at or below the path, whatever filesystem 
+// it is on. It is the only way to poll, for example, the lower directories of an overlay, 
+// which inotify sees through the overlay only as far as the changes made through it.
+{
+    std::string mount = path;
+    while ( mount.size() > 1 && mount.back() == '/' )
+	mount.pop_back();
+    for ( auto& it: poller.mounts )
+	if ( it.first == mount ) {
+	    it.second = polled;
+	    return;
+	}
+    poller.mounts.emplace_back(mount, polled);
+}
+
+template <typename Log>
+bool Inotify<Log>::polled(const std::string& path) const
+// Tell if a watch added for the path will be polled, as set by poll_mount() for the 
+// closest path above it, or otherwise if inotify is blind on its filesystem.
+{
+    const std::string* closest = nullptr;
+    bool polled = false;
+    for ( const auto& [mount, on]: poller.mounts ) {
+	const std::size_t size = mount == "/" ? 0 : mount.size();
+	if ( path.compare(0, size, mount, 0, size) == 0 &&
+	    (path.size() == size || path[size] == '/') &&
+	    (!closest || mount.size() > closest->size()) ) {
+	    closest = &mount;
+	    polled = on;
+	}
+    }
+    return closest ? polled : blind(path);
+}
+
+template <typename Log>
+bool Inotify<Log>::blind(const std::string& path) noexcept
+// Tell if the path is on a filesystem where inotify misses the changes, that is, those 
+// made by other hosts on a network filesystem, or behind the back of a FUSE filesystem.
+{
+    struct statfs st;
+    if ( statfs(path.c_str(), &st) == -1 )
+	return false;  // add_watch() will tell why.
+    switch ( uint32_t(st.f_type) ) {
+	case 0x6969:  // NFS_SUPER_MAGIC
+	case 0x517b:  // SMB_SUPER_MAGIC
+	case 0xff534d42:  // CIFS_SUPER_MAGIC
+	case 0xfe534d42:  // SMB2_SUPER_MAGIC
+	case 0x65735546:  // FUSE_SUPER_MAGIC
+	case 0x01021997:  // V9FS_MAGIC
+	case 0x00c36400:  // CEPH_SUPER_MAGIC
+	case 0x6b414653:  // AFS_FS_MAGIC
+	    return true;
+	default:
+	    return false;
+    }
+}
+
+template <typename Log>
+int Inotify<Log>::add_polled(const std::string& path, uint32_t parent,
+    std::string_view name, bool recursive, bool in_move, uint32_t mask, bool demoted)
+// Set up a polled watch for the path as add_watch() does for a kernel watch, with a 
+// pseudo wd of its own (-2, -3, ...), and take the snapshot of its entries to compare 
+// with when polled. The subdirectories and the IN_CREATE events for the children are 
+// set up as add_watch() does too.
+// If demoted, it is polled for the lack of kernel watches, and so are its subdirectories.
+{
+    // A directory found again, such as at the IN_MOVED_TO event for a watch we have 
+    // renamed already, is the same watch.
+    int found = -1;
+    if ( parent != Watches::none ) {
+	for ( uint32_t child = watches[parent].first_child ; child != Watches::none ;
+	    child = watches[child].next_sibling )
+	    if ( watches.name(watches[child]) == name )
+		found = watches[child].wd;
+    }
+    else
+	watches.for_each([&](const Watch& watch) {
+	    if ( watch.parent == Watches::none && watches.name(watch) == name )
+		found = watch.wd;
+	});
+    if ( found != -1 ) {
+	set_mask(found, mask);
+	return found;
+    }
+
+    Poll poll;
+    int ops = 0;
+    struct stat st;
+    const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 || fstat(dirfd, &st) == -1 || !list(dirfd, poll.entries, ops) ) {
+	const int error = errno;
+	if ( dirfd != -1 )
+	    close(dirfd);
+	blind_spot(path, error);
+	return -1;
+    }
+    if ( mask & (IN_MODIFY | IN_ATTRIB) )
+	stat_entries(dirfd, poll.entries, ops);
+    close(dirfd);
+    poll.mtime = st.st_mtim;
+    poll.interval = poller.min_interval;
+    poll.demoted = demoted;
+
+    const int wd = --last_pseudo_wd;
+    watches.link(watches.emplace(wd, name, recursive, mask), parent);
+    printf("[%d] %s created to poll\n", wd, this->path(wd).c_str());
+    const uint32_t slot = watches.slot(watches.at(wd));
+    Poll& polled = polls.emplace(wd, std::move(poll)).first->second;
+	// which stays in place while other polls are added below.
+    schedule(wd, polled, polled.interval);
+
+    if ( in_move && !recursive )
+	return wd;
+    for ( const Entry& entry: polled.entries ) {
+	const bool isdir = entry.type == DT_DIR;
+	if ( in_move ) {
+	    bool recursive = true;
+	    if ( isdir && !excluded(slot, entry.name, recursive) )
+		add_polled(path/entry.name.c_str(), slot, entry.name, recursive, true, mask,
+		    demoted);
+	}
+	else if ( mask & IN_CREATE || (isdir && recursive) )
+	    synthesize(wd, isdir ? IN_ISDIR | IN_CREATE : IN_CREATE,
+		entry.name.c_str(), entry.name.size());
+    }
+    return wd;
+}
+
+template <typename Log>
+void Inotify<Log>::blind_spot(const std::string& path, int error)
+// Log the directory that we could neither watch nor poll, and count it as unwatched 
+// unless it is simply gone.
+{
+    log("Warning: Cannot watch \"%s\": %s", path.c_str(), std::strerror(error));
+    if ( error != ENOENT && error != ENOTDIR )
+	++statistics.unwatched;
+}
+
+template <typename Log>
+int Inotify<Log>::poll_due()
+// Poll the directories that are due, as far as the budget allows, and return the time in 
+// milliseconds until the next one is due, or -1 if none is polled.
+// The budget is kept as a bucket of tokens, one for each system call, which fills up at 
+// budget tokens per second up to a second's worth. So, when many directories are due at 
+// once, their I/O is spread over time rather than coming in a burst.
+{
+    using namespace std::chrono;
+    const auto now = steady_clock::now();
+    poller.tokens = std::min(poller.budget,
+	poller.tokens + poller.budget * duration<double>(now - poller.refilled).count());
+    poller.refilled = now;
+
+    while ( !poller.schedule.empty() ) {
+	const auto [due, wd] = poller.schedule.top();
+	const auto found = polls.find(wd);
+	if ( found == polls.end() || found->second.due != due ) {
+	    poller.schedule.pop();  // stale
+	    continue;
+	}
+	if ( due > now )
+	    return ceil<milliseconds>(due - now).count();
+	if ( poller.tokens < 1 )
+	    return ceil<milliseconds>(
+		duration<double>((1 - poller.tokens) / poller.budget)).count();
+	poller.schedule.pop();
+	poller.tokens -= poll_dir(wd);
+    }
+    return -1;
+}
+
+template <typename Log>
+int Inotify<Log>::next_poll() noexcept
+// Return the time in milliseconds until try_read() should be called again to poll, or -1 
+// if nothing is polled, for an external event loop.
+// It is when poll_due() would poll the next directory, that is, when it is due and the 
+// budget has a token for it, so that the loop does not wake up only to find the budget 
+// empty, or for a stale item of the schedule, which is dropped here as well.
+{
+    using namespace std::chrono;
+    while ( !poller.schedule.empty() ) {
+	const auto [due, wd] = poller.schedule.top();
+	const auto found = polls.find(wd);
+	if ( found == polls.end() || found->second.due != due ) {
+	    poller.schedule.pop();  // stale
+	    continue;
+	}
+	const auto now = steady_clock::now();
+	const double tokens = std::min(poller.budget,
+	    poller.tokens + poller.budget * duration<double>(now - poller.refilled).count());
+	const long refill = tokens < 1 ?
+	    ceil<milliseconds>(duration<double>((1 - tokens) / poller.budget)).count() : 0;
+	return std::max({ 0L, long(ceil<milliseconds>(due - now).count()), refill });
+    }
+    return -1;
+}
+
+template <typename Log>
+int Inotify<Log>::poll_dir(int wd)
+// Poll the directory of wd, making up the events for what has changed since the last 
+// time, and schedule it again. Return the number of system calls it took.
+// We read the directory only if its mtime has changed, and otherwise stat only its files 
+// if mask asks for IN_MODIFY or IN_ATTRIB. The directories that have changed lately are 
+// polled more often than those that have not.
+{
+    Poll& poll = polls.at(wd);
+    const uint32_t slot = watches.slot(watches.at(wd));
+    const uint32_t mask = watches[slot].mask;
+    const std::string path = this->path(wd);
+    ++statistics.polls;
+
+    int ops = 1;
+    struct stat st;
+    const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 || fstat(dirfd, &st) == -1 ) {
+	const int error = errno;
+	const uint32_t parent = watches[slot].parent;
+	if ( dirfd != -1 )
+	    close(dirfd);
+	if ( error != ENOENT && error != ENOTDIR ) {
+	    log("Warning: Cannot read \"%s\": %s", path.c_str(), std::strerror(error));
+	    schedule(wd, poll, poll.interval);
+	}
+	else if ( parent == Watches::none )
+	    vanish(slot);  // The root is gone.
+	else {
+	    // Its parent will find out what has happened to it, by polling it at once or 
+	    // by its kernel watch (or by rescan() if overflowed).
+	    const auto polled = polls.find(watches[parent].wd);
+	    if ( polled != polls.end() )
+		schedule(polled->first, polled->second, 0);
+	    schedule(wd, poll, poll.interval);
+	}
+	return ops;
+    }
+
+    bool changed = false;
+    if ( st.st_mtim.tv_sec != poll.mtime.tv_sec || st.st_mtim.tv_nsec != poll.mtime.tv_nsec ) {
+	std::vector<Entry> entries;
+	if ( !list(dirfd, entries, ops) )
+	    log("Warning: Cannot read \"%s\": %s", path.c_str(), std::strerror(errno));
+	else {
+	    if ( mask & (IN_MODIFY | IN_ATTRIB) )
+		stat_entries(dirfd, entries, ops);
+	    changed = diff(wd, poll.entries, entries);
+	    poll.entries = std::move(entries);
+	    poll.mtime = st.st_mtim;
+	}
+    }
+    else if ( mask & (IN_MODIFY | IN_ATTRIB) ) {
+	std::vector<Entry> entries = poll.entries;
+	stat_entries(dirfd, entries, ops);
+	changed = diff(wd, poll.entries, entries);
+	poll.entries = std::move(entries);
+    }
+    close(dirfd);
+
+    poll.interval = changed ? poller.min_interval :
+	std::min(poll.interval * 2, poller.max_interval);
+    schedule(wd, poll, poll.interval);
+
+    if ( changed && poll.demoted ) {
+	// A demoted subtree turned hot is to be promoted back by rebudget(), from its top.
+	uint32_t top = slot;
+	for ( uint32_t up = watches[top].parent ; up != Watches::none && demoted(up) ;
+	    up = watches[up].parent )
+	    top = up;
+	float heat = 0;
+	watches.for_each_in_subtree(top,
+	    [&heat](const Watch& watch) { heat += watch.heat; });
+	if ( heat >= budget.hot &&
+	    std::find(budget.promote.begin(), budget.promote.end(), watches[top].wd) ==
+		budget.promote.end() )
+	    budget.promote.push_back(watches[top].wd);
+    }
+    return ops;
+}
+
+template <typename Log>
+bool Inotify<Log>::list(int dirfd, std::vector<Entry>& entries, int& ops)
+// Read the directories, regular files, and symlinks in the directory opened as dirfd into 
+// entries, sorted by name, or return false with errno set if failed.
+{
+    ++ops;
+    if ( !for_each_entry(dirfd, [&entries](const char* name, unsigned char type, ino_t ino) {
+	if ( type == DT_DIR || type == DT_REG || type == DT_LNK )
+	    entries.push_back(Entry { name, ino, type, {}, {} });
+    }) )
+	return false;
+    std::sort(entries.begin(), entries.end(),
+	[](const Entry& a, const Entry& b) { return a.name < b.name; });
+    return true;
+}
+
+template <typename Log>
+void Inotify<Log>::stat_entries(int dirfd, std::vector<Entry>& entries, int& ops)
+// Read the timestamps of the files (but not directories) in entries.
+{
+    for ( Entry& entry: entries )
+	if ( entry.type != DT_DIR ) {
+	    ++ops;
+	    struct stat st;
+	    if ( fstatat(dirfd, entry.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 ) {
+		entry.mtime = st.st_mtim;
+		entry.ctime = st.st_ctim;
+	    }
+	}
+}
+
+template <typename Log>
+bool Inotify<Log>::diff(int wd, const std::vector<Entry>& old,
+    const std::vector<Entry>& fresh)
+// Make up the events for what has changed in the directory of the polled wd, from the 
+// old entries to the fresh ones, and return true if anything has.
+// An entry gone and another come with the same inode are taken as moved, within the 
+// directory. A directory moved out to or in from another directory, though, is taken as 
+// deleted or created, since the two directories are polled at different times.
+{
+    const uint32_t slot = watches.slot(watches.at(wd));
+    const auto child = [this, slot](const std::string& name) {
+	for ( uint32_t child = watches[slot].first_child ; child != Watches::none ;
+	    child = watches[child].next_sibling )
+	    if ( watches.name(watches[child]) == name )
+		return child;
+	return Watches::none;
+    };
+    const auto same = [](const timespec& a, const timespec& b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+    };
+
+    // Both are sorted by name, so we merge them.
+    std::vector<const Entry*> gone, come;
+    bool changed = false;
+    for ( auto o = old.begin(), n = fresh.begin() ; o != old.end() || n != fresh.end() ; ) {
+	const int order = o == old.end() ? 1 : n == fresh.end() ? -1 :
+	    o->name.compare(n->name);
+	if ( order < 0 )
+	    gone.push_back(&*o++);
+	else if ( order > 0 )
+	    come.push_back(&*n++);
+	else {
+	    if ( o->ino != n->ino || o->type != n->type ) {  // replaced
+		gone.push_back(&*o);
+		come.push_back(&*n);
+	    }
+	    else if ( n->type != DT_DIR && !same(o->mtime, n->mtime) ) {
+		synthesize(wd, IN_MODIFY, n->name.c_str(), n->name.size());
+		changed = true;
+	    }
+	    else if ( n->type != DT_DIR && !same(o->ctime, n->ctime) ) {
+		synthesize(wd, IN_ATTRIB, n->name.c_str(), n->name.size());
+		changed = true;
+	    }
+	    ++o, ++n;
+	}
+    }
+    if ( gone.empty() && come.empty() )
+	return changed;
+
+    std::unordered_map<ino_t, const Entry*> moved;  // entries come, by inode
+    std::unordered_set<const Entry*> taken;  // of them, paired with the entries gone
+    for ( const Entry* entry: come )
+	moved.emplace(entry->ino, entry);
+    for ( const Entry* entry: gone ) {
+	const uint32_t isdir = entry->type == DT_DIR ? IN_ISDIR : 0;
+	const auto to = moved.find(entry->ino);
+	if ( to != moved.end() && to->second->type == entry->type &&
+	    taken.insert(to->second).second ) {
+	    const std::string& name = to->second->name;
+	    if ( isdir )
+		if ( const uint32_t moving = child(entry->name) ; moving != Watches::none )
+		    watches.rename(watches[moving], name);
+	    const uint32_t cookie = ++poller.cookie;
+	    synthesize(wd, isdir | IN_MOVED_FROM, entry->name.c_str(), entry->name.size(),
+		cookie);
+	    synthesize(wd, isdir | IN_MOVED_TO, name.c_str(), name.size(), cookie);
+	    continue;
+	}
+
+	synthesize(wd, isdir | IN_DELETE, entry->name.c_str(), entry->name.size());
+	if ( isdir )
+	    if ( const uint32_t deleted = child(entry->name) ; deleted != Watches::none )
+		vanish(deleted);
+    }
+    for ( const Entry* entry: come )
+	if ( !taken.count(entry) )
+	    synthesize(wd, entry->type == DT_DIR ? IN_ISDIR | IN_CREATE : IN_CREATE,
+		entry->name.c_str(), entry->name.size());
+    return true;
+}
+
+template <typename Log>
+void Inotify<Log>::vanish(uint32_t slot)
+// Make up IN_DELETE_SELF and IN_IGNORED events for the polled watch at slot and all the 
+// watches below it, from the bottom up as kernel does for a directory tree deleted, and 
+// stop polling them. The watches are erased as their IN_IGNORED events are read.
+{
+    watches.for_each_in_subtree(slot, [this](const Watch& watch) {
+	synthesize(watch.wd, IN_DELETE_SELF, "", 0);
+	synthesize(watch.wd, IN_IGNORED, "", 0);
+	polls.erase(watch.wd);
+    });
+}
+
+template <typename Log>
+void Inotify<Log>::rebudget()
+// Keep the kernel watches within the budget, at most every 100 ms: demote the coldest 
+// subtrees to polling once high of the limit is in use, or otherwise promote the 
+// demoted subtrees turned hot as far as the limit allows. The heat of every watch is 
+// halved every minute.
+// Each directory demoted is read for its snapshot, so up to max_demotions of them (or 
+// a few more, as subtrees go) are demoted at each call, which goes on at the next calls 
+// down to low of the limit, so as not to hold up the events for long.
+// Should be called only when all the events in the buffer and all the synthetic events 
+// have been handled, since the wds change.
+{
+    using namespace std::chrono;
+    const auto now = steady_clock::now();
+    if ( now - budget.checked < milliseconds(100) )
+	return;
+    budget.checked = now;
+
+    if ( const auto minutes = duration_cast<std::chrono::minutes>(now - budget.decayed)
+	.count() ; minutes > 0 ) {
+	const float factor = minutes < 32 ? 1.0f / (1u << minutes) : 0;
+	watches.for_each([factor](Watch& watch) { watch.heat *= factor; });
+	budget.decayed += std::chrono::minutes(minutes);
+    }
+
+    if ( !budget.limit )
+	return;
+    const std::size_t used = watches.count(false);
+    const std::size_t low = budget.limit * budget.low;
+    if ( used >= budget.limit * budget.high )
+	budget.demoting = true;
+    if ( budget.demoting ) {
+	budget.demoting = used > low && demote(std::min(used - low, max_demotions)) > 0;
+	return;
+    }
+    while ( !budget.promote.empty() ) {
+	const Watch* const top = watches.find(budget.promote.back());
+	budget.promote.pop_back();
+	if ( top && demoted(watches.slot(*top)) )
+	    promote_subtree(watches.slot(*top));
+    }
+}
+
+template <typename Log>
+std::size_t Inotify<Log>::demote(std::size_t count)
+// Demote at least count kernel watches to polling, taking the subtrees of the least heat 
+// per watch first, and of them the larger ones, but not much larger than needed, and 
+// never larger than twice the count. Return the number of kernel watches demoted.
+// The root watches stay in kernel, so that the wds returned by add_watch() stay valid.
+{
+    std::vector<float> heat(watches.capacity());
+    std::vector<std::size_t> size(watches.capacity());  // kernel watches in each subtree
+    std::vector<uint32_t> candidates;
+    watches.for_each([&](const Watch& watch) {
+	if ( watch.parent == Watches::none )
+	    watches.for_each_in_subtree(watches.slot(watch), [&](const Watch& watch) {
+		const uint32_t slot = watches.slot(watch);
+		heat[slot] = watch.heat;
+		size[slot] = watch.wd >= 0;
+		for ( uint32_t child = watch.first_child ; child != Watches::none ;
+		    child = watches[child].next_sibling ) {
+		    heat[slot] += heat[child];
+		    size[slot] += size[child];
+		}
+		if ( watch.wd >= 0 && watch.parent != Watches::none )
+		    candidates.push_back(slot);
+	    });
+    });
+    std::sort(candidates.begin(), candidates.end(), [&](uint32_t a, uint32_t b) {
+	const float x = heat[a] * size[b], y = heat[b] * size[a];  // heat[] / size[]
+	return x < y || (x == y && size[a] > size[b]);
+    });
+
+    std::vector<bool> taken(watches.capacity());  // slots demoted, with their subtrees
+    const std::size_t most = count * 2;
+    std::size_t total = 0;  // demoted so far
+    for ( int pass = 0 ; pass < 2 && count > 0 ; ++pass )
+	for ( const uint32_t slot: candidates ) {
+	    if ( count == 0 )
+		break;
+	    if ( taken[slot] || size[slot] == 0 ||
+		size[slot] > (pass == 0 ? count * 2 : most) )
+		continue;  // The first pass skips the subtrees much larger than needed.
 
-    // So far, We got some events and handled all of them, but we could not report any 
-    // events of interest to the caller. We will take another oppertunity to read more 
-    // events only if we have enough time left though, or report nothing otherwise.
+	    const std::size_t subtree = size[slot];
+	    log("Info: %s demoted to polling, with %zu watches",
+		path(watches[slot].wd).c_str(), subtree);
+	    watches.for_each_in_subtree(slot, [&taken, this](const Watch& watch) {
+		taken[watches.slot(watch)] = true;
+	    });
+	    demote_subtree(slot);
+	    for ( uint32_t up = watches[slot].parent ; up != Watches::none ;
+		up = watches[up].parent )
+		size[up] -= subtree;
+	    count -= std::min(count, subtree);
+	    total += subtree;
+	}
+    return total;
+}
+
+template <typename Log>
+void Inotify<Log>::demote_subtree(uint32_t slot)
+// Turn the kernel watches in the subtree at slot into polled ones, each with a pseudo wd 
+// and a snapshot of its entries taken before its kernel watch is removed. The events for 
+// the old wds still in kernel are taken over by the pseudo wds through budget.aliases.
+{
+    watches.for_each_in_subtree(slot, [this](const Watch& found) {
+	if ( found.wd < 0 )
+	    return;
+	Watch& watch = watches[watches.slot(found)];
+	const std::string path = this->path(watch.wd);
+
+	Poll poll;
+	int ops = 0;
+	struct stat st;
+	const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ( dirfd == -1 || fstat(dirfd, &st) == -1 || !list(dirfd, poll.entries, ops) ) {
+	    // It is gone, which its kernel watch will tell soon.
+	    if ( dirfd != -1 )
+		close(dirfd);
+	    return;
+	}
+	if ( watch.mask & (IN_MODIFY | IN_ATTRIB) )
+	    stat_entries(dirfd, poll.entries, ops);
+	close(dirfd);
+	poll.mtime = st.st_mtim;
+	poll.interval = poller.max_interval;  // as it has been cold.
+	poll.demoted = true;
+
+	const int wd = watch.wd, pseudo_wd = --last_pseudo_wd;
+	watches.rekey(watch, pseudo_wd);
+	budget.aliases[wd] = pseudo_wd;
+	inotify_rm_watch(fd, wd);
+	Poll& polled = polls.emplace(pseudo_wd, std::move(poll)).first->second;
+	schedule(pseudo_wd, polled, polled.interval);
+	++statistics.evictions;
+    });
+}
+
+template <typename Log>
+void Inotify<Log>::promote_subtree(uint32_t slot)
+// Turn the demoted watches in the subtree at slot back into kernel watches, from the top 
+// down, if they all fit in the limit. Each catches up with what has changed since it was 
+// polled last, as a poll would.
+{
+    std::vector<uint32_t> slots;  // of the demoted watches
+    watches.for_each_in_subtree(slot, [&slots, this](const Watch& watch) {
+	if ( watch.parent != Watches::none && demoted(watches.slot(watch)) )
+	    slots.push_back(watches.slot(watch));
+    });
+    if ( watches.count(false) + slots.size() > budget.limit )
+	return;  // It will be queued again if it stays hot.
+    log("Info: %s promoted from polling, with %zu watches",
+	path(watches[slot].wd).c_str(), slots.size());
 
-    const int time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-	std::chrono::system_clock::now() - then).count();
-    if ( timeout < 0 /* == -1 */ || (timeout -= time_elapsed) > 0 )
-	return read(timeout, read_delay);  // The tail-call optimization will work here.
+    std::reverse(slots.begin(), slots.end());  // from the top down
+    for ( const uint32_t slot: slots ) {
+	if ( !demoted(slot) )
+	    continue;  // gone while its parent caught up
+	Watch& watch = watches[slot];
+	const std::string path = this->path(watch.wd);
+	const int wd = inotify_add_watch(fd, path.c_str(),
+	    watch_mask(watch.mask, watch.recursive));
+	if ( wd == -1 && errno == ENOSPC ) {
+	    budget.limit = watches.count(false);
+	    return;
+	}
+	if ( wd == -1 || watches.find(wd) )
+	    continue;  // gone, which its poll will tell, or watched elsewhere.
+
+	const int pseudo_wd = watch.wd;
+	const Poll poll = std::move(polls.at(pseudo_wd));
+	polls.erase(pseudo_wd);
+	watches.rekey(watch, wd);
+	++statistics.promotions;
 
-    return nullptr;  // timed out!
+	std::vector<Entry> entries;
+	int ops = 0;
+	const int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ( dirfd == -1 )
+	    continue;  // gone, which its kernel watch will tell.
+	if ( list(dirfd, entries, ops) ) {
+	    if ( watch.mask & (IN_MODIFY | IN_ATTRIB) )
+		stat_entries(dirfd, entries, ops);
+	    diff(wd, poll.entries, entries);
+	}
+	close(dirfd);
+    }
 }
 
 #endif /* INOTIFY_HPP */
@@ -0,0 +1,289 @@
+// Reactor that serves many Inotify instances, timers, and other fds with a single epoll
+//
+// How to use:
+//   Reactor reactor;
+//   reactor.add(inotify, [&](const inotify_event& event) { ... });
+//   reactor.add_timer(std::chrono::seconds(1), std::chrono::seconds(1), [] { ... });
+//   reactor.add_fd(socket, EPOLLIN, [&](uint32_t events) { ... });
+//   reactor.run();  // from one or more threads, until reactor.stop()
+//
+// Every source is registered with EPOLLONESHOT, so that it is served by only one thread at
+// a time even if run() is called from a pool of threads, and it is re-armed after its
+// callback returns. Each wakeup costs only as much as the sources ready.
+
+
+
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <atomic>  // atomic<>
+#include <chrono>  // nanoseconds, duration_cast<>
+#include <cstdint>  // uint32_t, uint64_t
+#include <functional>  // function<>
+#include <memory>  // shared_ptr<>, make_shared<>
+#include <mutex>  // mutex, lock_guard<>
+#include <system_error>  // errno, system_error, system_category
+#include <unordered_map>  // unordered_map<>
+#include <utility>  // move()
+#include "inotify.hpp"  // Inotify<>
+extern "C" {
+#include <sys/epoll.h>  // epoll_*(), EPOLL*
+#include <sys/eventfd.h>  // eventfd(), EFD_*
+#include <sys/timerfd.h>  // timerfd_*(), TFD_*, itimerspec
+#include <unistd.h>  // read(), write(), close()
+}
+
+class Reactor {
+    struct Source {
+	int fd;  // fd registered in the epoll set
+	uint32_t events;  // events to be re-armed with
+	bool owned;  // if fd is ours to close, like a timerfd
+	std::function<void(uint32_t)> handler;  // called with the events ready
+
+	Source(int fd, uint32_t events, bool owned, std::function<void(uint32_t)> handler):
+	    fd { fd }, events { events }, owned { owned }, handler { std::move(handler) } {}
+	Source(const Source&) = delete;
+	~Source() { if ( owned ) close(fd); }
+	    // An owned fd is closed only when its callback, which may be running while the 
+	    // source is removed, is done with it.
+    };
+
+    const int epfd;
+    const int stop_fd;  // eventfd to wake up all the threads in run() to stop
+    std::atomic<bool> stopped { false };
+
+    std::mutex sources_mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<Source>> sources;  // by id
+    uint64_t last_id = 0;
+	// The ids are never reused, so that an event for a source removed while it was
+	// ready is simply dropped.
+
+    static constexpr uint64_t stop_id = 0;
+
+    int add(int fd, uint32_t events, bool owned, std::function<void(uint32_t)> handler);
+
+public:
+    // Note, member functions that are not specified as noexcept may throw an
+    // system_error exception, which results from system call errors.
+
+    Reactor():
+	epfd { epoll_create1(EPOLL_CLOEXEC) },
+	stop_fd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) }
+    {
+	epoll_event event {};
+	event.events = EPOLLIN;  // not EPOLLONESHOT, so that every thread sees it.
+	event.data.u64 = stop_id;
+	if ( epfd == -1 || stop_fd == -1 ||
+	    epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &event) == -1 ) {
+	    const int error = errno;
+	    close(epfd);
+	    close(stop_fd);
+	    throw std::system_error(error, std::system_category());
+	}
+    }
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    ~Reactor() {
+	sources.clear();
+	close(epfd);
+	close(stop_fd);
+    }
+
+    template <typename Log, typename F>
+    int add(Inotify<Log>& inotify, F on_event);
+	// Call on_event(event) for every event of the inotify, and return its id.
+    int add_timer(std::chrono::nanoseconds first, std::chrono::nanoseconds interval,
+	std::function<void()> on_expire);
+	// Call on_expire() after first and then every interval (unless zero).
+    int add_fd(int fd, uint32_t events, std::function<void(uint32_t)> on_ready) {
+	// Call on_ready(events ready) when the fd is ready for the events (as EPOLLIN).
+	return add(fd, events, false, std::move(on_ready));
+    }
+    void remove(int id) noexcept;
+	// The callback of the source may still be running in another thread.
+    static void set_timer(int fd, int timeout) noexcept;
+	// Arm the timerfd to expire in timeout milliseconds, or disarm it if -1.
+
+    bool run_once(int timeout =(-1));
+    void run() { while ( run_once() ) {} }
+    void stop() noexcept {
+	// Make every run() and run_once() return at once, now and from now on.
+	stopped = true;
+	const uint64_t one = 1;
+	while ( ::write(stop_fd, &one, sizeof(one)) == -1 && errno == EINTR ) {}
+    }
+};
+
+inline int Reactor::add(int fd, uint32_t events, bool owned,
+    std::function<void(uint32_t)> handler)
+{
+    std::lock_guard<std::mutex> lock { sources_mutex };
+    const uint64_t id = ++last_id;
+    epoll_event event {};
+    event.events = events | EPOLLONESHOT;
+    event.data.u64 = id;
+    if ( epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1 )
+	throw std::system_error(errno, std::system_category());
+    sources.emplace(id, std::make_shared<Source>(fd, events, owned, std::move(handler)));
+    return id;
+}
+
+template <typename Log, typename F>
+int Reactor::add(Inotify<Log>& inotify, F on_event)
+// The inotify has two fds to wait on, one for events and the other for commands posted by
+// post(), and a timerfd of ours for next_poll() if it polls any watch, but should be
+// served by one thread at a time. So, we put them into an epoll set of its own, which is
+// ready when any of them is, and register that set instead.
+{
+    const int inner = epoll_create1(EPOLL_CLOEXEC);
+    if ( inner == -1 )
+	throw std::system_error(errno, std::system_category());
+    const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( timer == -1 ) {
+	const int error = errno;
+	close(inner);
+	throw std::system_error(error, std::system_category());
+    }
+    const std::shared_ptr<const int> poll_timer { new int(timer),
+	[](const int* fd) { close(*fd); delete fd; } };  // closed with the callback
+    for ( const int fd: { inotify.native_handle(), inotify.wake_handle(), timer } ) {
+	epoll_event event {};
+	event.events = EPOLLIN;
+	if ( epoll_ctl(inner, EPOLL_CTL_ADD, fd, &event) == -1 ) {
+	    const int error = errno;
+	    close(inner);
+	    throw std::system_error(error, std::system_category());
+	}
+    }
+    set_timer(timer, inotify.next_poll());
+
+    try {
+	return add(inner, EPOLLIN, true, [&inotify, on_event, poll_timer](uint32_t) mutable {
+	    while ( const inotify_event* event = inotify.try_read() )
+		on_event(*event);
+	    set_timer(*poll_timer, inotify.next_poll());  // now that try_read() has polled
+	});
+    }
+    catch (...) {
+	close(inner);
+	throw;
+    }
+}
+
+inline int Reactor::add_timer(std::chrono::nanoseconds first,
+    std::chrono::nanoseconds interval, std::function<void()> on_expire)
+{
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( fd == -1 )
+	throw std::system_error(errno, std::system_category());
+
+    const auto timespec_of = [](std::chrono::nanoseconds time) {
+	return timespec { time_t(time.count() / 1000000000), long(time.count() % 1000000000) };
+    };
+    itimerspec spec;
+    spec.it_value = timespec_of(first.count() > 0 ? first : std::chrono::nanoseconds(1));
+	// A zero it_value would disarm the timer.
+    spec.it_interval = timespec_of(interval);
+    if ( timerfd_settime(fd, 0, &spec, nullptr) == -1 ) {
+	const int error = errno;
+	close(fd);
+	throw std::system_error(error, std::system_category());
+    }
+
+    try {
+	return add(fd, EPOLLIN, true, [fd, on_expire = std::move(on_expire)](uint32_t) {
+	    uint64_t expirations;
+	    if ( ::read(fd, &expirations, sizeof(expirations)) > 0 )
+		on_expire();
+		// We call it only once for expirations missed while busy, like a periodic
+		// task would skip its overdue runs.
+	});
+    }
+    catch (...) {
+	close(fd);
+	throw;
+    }
+}
+
+inline void Reactor::set_timer(int fd, int timeout) noexcept
+// The expirations so far are consumed, so that the timerfd is no longer ready until the
+// new timeout.
+{
+    uint64_t expirations;
+    while ( ::read(fd, &expirations, sizeof(expirations)) > 0 ) {}
+    itimerspec spec {};  // disarmed if all zero
+    if ( timeout >= 0 )
+	spec.it_value = timespec { time_t(timeout / 1000), long(timeout % 1000) * 1000000 + 1 };
+	// A zero it_value would disarm the timer.
+    timerfd_settime(fd, 0, &spec, nullptr);
+}
+
+inline void Reactor::remove(int id) noexcept
+{
+    std::lock_guard<std::mutex> lock { sources_mutex };
+    const auto found = sources.find(id);
+    if ( found == sources.end() )
+	return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, found->second->fd, nullptr);
+    sources.erase(found);
+}
+
+inline bool Reactor::run_once(int timeout)
+// Wait for the sources ready and call their callbacks, or return false if stopped.
+// It can be called from many threads at once, and any exception from a callback is
+// passed through after the source is re-armed.
+{
+    if ( stopped )
+	return false;
+
+    epoll_event events[64];
+    const int count = epoll_wait(epfd, events, 64, timeout);
+    if ( count == -1 ) {
+	if ( errno == EINTR )
+	    return true;
+	throw std::system_error(errno, std::system_category());
+    }
+
+    const auto rearm = [this](uint64_t id) {
+	std::lock_guard<std::mutex> lock { sources_mutex };
+	const auto found = sources.find(id);
+	if ( found != sources.end() ) {  // if not removed,
+	    epoll_event event {};
+	    event.events = found->second->events | EPOLLONESHOT;
+	    event.data.u64 = id;
+	    epoll_ctl(epfd, EPOLL_CTL_MOD, found->second->fd, &event);
+	}
+    };
+
+    for ( int i = 0 ; i < count ; ++i ) {
+	const uint64_t id = events[i].data.u64;
+	if ( id == stop_id )
+	    continue;
+
+	std::shared_ptr<Source> source;
+	{
+	    std::lock_guard<std::mutex> lock { sources_mutex };
+	    const auto found = sources.find(id);
+	    if ( found == sources.end() )
+		continue;  // removed already
+	    source = found->second;
+	}
+
+	try {
+	    source->handler(events[i].events);
+	}
+	catch (...) {
+	    // Re-arm also the sources ready but not served yet, which will be reported
+	    // again since they are level-triggered.
+	    for ( int j = i ; j < count ; ++j )
+		if ( events[j].data.u64 != stop_id )
+		    rearm(events[j].data.u64);
+	    throw;
+	}
+	rearm(id);
+    }
+    return !stopped;
+}
+
+#endif /* REACTOR_HPP */
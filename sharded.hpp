@@ -0,0 +1,427 @@
+// Inotify sharded across multiple inotify instances
+//
+// How to use:
+//   ShardedInotify<> inotify { log, 4 };  // with 4 shards
+//   inotify.add_watch("/home/user1");
+//   inotify.add_watch("/home/user2");
+//   ShardedInotify<>::Event event;
+//   while ( inotify.receive(event) )
+//       ...  // event.path, event.mask, ...
+//
+// Each inotify instance has its own kernel queue of max_queued_events, so a busy directory
+// tree can overflow the queue for all the others under a single instance. Here, each
+// watch given to add_watch() (a root) goes to one of the shards, each of which is an
+// Inotify drained by a thread of its own, so that the queue capacity and the throughput
+// to drain grow with the number of shards.
+// The events read by each shard wait in a queue of its own for receive(), which holds up
+// to set_capacity() events. Once it is full, further events of the shard are dropped
+// after a single IN_Q_OVERFLOW, as kernel does, while the watches are still kept up to
+// date by them.
+
+
+
+#ifndef SHARDED_HPP
+#define SHARDED_HPP
+
+#include <algorithm>  // max(), min_element()
+#include <chrono>  // milliseconds
+#include <condition_variable>  // condition_variable
+#include <cstdint>  // uint32_t, uint64_t, SIZE_MAX
+#include <deque>  // deque<>
+#include <exception>  // exception_ptr, current_exception(), rethrow_exception()
+#include <memory>  // unique_ptr<>
+#include <mutex>  // mutex, unique_lock<>
+#include <string>  // string
+#include <thread>  // thread
+#include <type_traits>  // invoke_result_t<>
+#include <utility>  // move(), exchange()
+#include <vector>  // vector<>
+#include "inotify.hpp"  // Inotify<>
+
+template <typename Log =Syslog<LOG_ERR>>
+class ShardedInotify {
+public:
+    struct Event {
+	int wd;  // wd in the shard
+	uint32_t mask;
+	uint32_t cookie;
+	std::string path;  // full pathname of the directory, or of its entry if named
+	unsigned shard;  // shard that has reported the event
+	uint64_t seq;  // sequence number in the shard, skipping those dropped on overflow
+    };
+
+private:
+    struct Root {  // watch given to add_watch()
+	std::string path;
+	int wd;
+	uint32_t mask;  // given to add_watch()
+	uint64_t events = 0;  // since the last rebalance()
+    };
+
+    struct Shard {
+	std::unique_ptr<Inotify<Log>> inotify;
+	std::thread reader;
+	std::deque<std::pair<uint64_t, Event>> queue;
+	    // events read, each with its arrival number over all the shards
+	std::vector<Root> roots;
+	uint64_t seq = 0;  // sequence number for the next event
+	uint64_t events = 0;  // since the last rebalance()
+	std::exception_ptr stopped;  // what stopped the reader, if any
+    };
+
+    const Log& log;
+    const int read_delay;
+    std::vector<Shard> shards;
+
+    std::mutex mutex;  // to guard the queues and roots of shards, and the members below
+    std::condition_variable ready;
+	// notified when an event is queued, a call() is done, or cancelled
+    bool cancelled = false;
+    std::exception_ptr error;  // what stopped a reader, if any, for receive() to rethrow
+    uint64_t arrivals = 0;  // events queued so far over all the shards
+    std::size_t capacity = 65536;  // events each queue can hold
+
+    void read_loop(unsigned shard) noexcept;
+    template <typename F>
+    auto call(Shard& shard, F f) -> std::invoke_result_t<F, Inotify<Log>&>;
+    static bool under(const std::string& path, const std::string& root) noexcept;
+
+public:
+    // Note, member functions that are not specified as noexcept may throw an
+    // system_error exception, which results from system call errors.
+
+    ShardedInotify(const Log& log, unsigned shards, uint32_t mask =IN_ALL_EVENTS,
+	int read_delay =0, std::size_t buffer_size =4 *1024, std::size_t max_buffer_size =0);
+	// The arguments except shards are passed to every Inotify, and read_delay to its
+	// read(), as they are.
+    ShardedInotify(const ShardedInotify&) = delete;
+    ShardedInotify& operator=(const ShardedInotify&) = delete;
+    ~ShardedInotify();
+
+    void exclude(const std::string& root, const std::string& pattern);
+    int add_watch(const std::string& path, uint32_t mask =0);
+    void rm_watch(const std::string& path);
+
+    bool receive(Event& event, int timeout =(-1));
+    void cancel() noexcept {
+	// Wake up receive() at once, which then returns false as if timed out, now or at
+	// the next call.
+	std::lock_guard<std::mutex> lock { mutex };
+	cancelled = true;
+	ready.notify_all();
+    }
+
+    bool rebalance();
+    void set_watch_budget(std::size_t limit, double high =0.9, double low =0.8,
+	float hot =8);
+    void set_capacity(std::size_t events) noexcept {
+	// Let the queue of each shard hold up to the events (at least 1) for receive().
+	std::lock_guard<std::mutex> lock { mutex };
+	capacity = std::max<std::size_t>(1, events);
+    }
+    unsigned size() const noexcept { return shards.size(); }
+    typename Inotify<Log>::Stats stats(unsigned shard) {
+	return call(shards.at(shard), [](auto& inotify) { return inotify.stats(); });
+    }
+};
+
+template <typename Log>
+ShardedInotify<Log>::ShardedInotify(const Log& log, unsigned shards, uint32_t mask,
+    int read_delay, std::size_t buffer_size, std::size_t max_buffer_size):
+    log { log }, read_delay { read_delay }, shards(std::max(1u, shards))
+{
+    for ( Shard& shard: this->shards )
+	shard.inotify.reset(new Inotify<Log>(log, mask, buffer_size, max_buffer_size));
+    for ( unsigned i = 0 ; i < this->shards.size() ; ++i )
+	this->shards[i].reader = std::thread(&ShardedInotify::read_loop, this, i);
+}
+
+template <typename Log>
+ShardedInotify<Log>::~ShardedInotify()
+{
+    for ( Shard& shard: shards ) {
+	shard.inotify->cancel();
+	shard.reader.join();
+    }
+}
+
+template <typename Log>
+void ShardedInotify<Log>::read_loop(unsigned id) noexcept
+// Body of the reader thread for a shard, which reads events in batches and queues them
+// with their full pathnames, taking the lock only once for each batch.
+// Each event is resolved as soon as read_batch() appends it, as drain() does, since the
+// events after it in the batch may erase or move its watch.
+// The reader never waits for room in the queue, since it has to come back to read() to
+// run the commands posted by call(), which receive() may be waiting for.
+{
+    Shard& shard = shards[id];
+    Inotify<Log>& inotify = *shard.inotify;
+    std::vector<typename Inotify<Log>::Event> batch;  // resolved as read_batch() goes
+
+    try {
+	while ( batch.clear(), inotify.read_batch(batch, SIZE_MAX, -1, read_delay) ) {
+	    std::lock_guard<std::mutex> lock { mutex };
+	    for ( auto& event: batch ) {
+		for ( Root& root: shard.roots )
+		    if ( under(event.path, root.path) ) {
+			++root.events;
+			break;
+		    }
+		if ( shard.queue.size() < capacity )
+		    shard.queue.emplace_back(arrivals++, Event { event.wd, event.mask,
+			event.cookie, std::move(event.path), id, shard.seq++ });
+		else {
+		    if ( shard.queue.back().second.mask != IN_Q_OVERFLOW ) {
+			log("Warning: Queue of shard %u overflowed", id);
+			shard.queue.emplace_back(arrivals++,
+			    Event { -1, IN_Q_OVERFLOW, 0, std::string(), id, shard.seq });
+		    }
+		    ++shard.seq;  // dropped!
+		}
+	    }
+	    shard.events += batch.size();
+	    ready.notify_all();
+	}
+    }
+    catch (...) {
+	std::lock_guard<std::mutex> lock { mutex };
+	error = shard.stopped = std::current_exception();
+	ready.notify_all();  // Wake up receive() and call() as well.
+    }
+}
+
+template <typename Log>
+template <typename F>
+auto ShardedInotify<Log>::call(Shard& shard, F f) -> std::invoke_result_t<F, Inotify<Log>&>
+// Run f(inotify) by the reader of the shard through Inotify::post(), and return its
+// result, or rethrow what has stopped the reader if it has stopped without running it,
+// rather than waiting for it forever.
+{
+    bool done = false;
+    auto result = shard.inotify->post([this, &done, f = std::move(f)](auto& inotify) {
+	struct Done {  // to tell the caller even when f() throws
+	    ShardedInotify& sharded;
+	    bool& done;
+	    ~Done() {
+		std::lock_guard<std::mutex> lock { sharded.mutex };
+		done = true;
+		sharded.ready.notify_all();
+	    }
+	} guard { *this, done };
+	return f(inotify);
+    });
+
+    {
+	std::unique_lock<std::mutex> lock { mutex };
+	ready.wait(lock, [&] { return done || shard.stopped; });
+	if ( !done )
+	    std::rethrow_exception(shard.stopped);
+    }
+    return result.get();  // which is ready, or about to be as f() has returned.
+}
+
+template <typename Log>
+bool ShardedInotify<Log>::under(const std::string& path, const std::string& root) noexcept
+// Tell if the path is the root or below it.
+{
+    std::size_t size = root.size();
+    if ( size > 1 && root.back() == '/' )
+	--size;
+    return path.compare(0, size, root, 0, size) == 0 &&
+	(path.size() == size || path[size] == '/');
+}
+
+template <typename Log>
+int ShardedInotify<Log>::add_watch(const std::string& path, uint32_t mask)
+// Add the watch (as Inotify::add_watch() does, with the mask) to the shard with the
+// fewest events so far, or with the fewest roots if even, and return the shard, or -1 if
+// failed.
+{
+    unsigned id;
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	id = std::min_element(shards.begin(), shards.end(),
+	    [](const Shard& a, const Shard& b) {
+		return a.events < b.events ||
+		    (a.events == b.events && a.roots.size() < b.roots.size());
+	    }) - shards.begin();
+    }
+
+    const int wd = call(shards[id], [path, mask](auto& inotify) {
+	return inotify.add_watch(path, true, mask);
+    });
+    if ( wd == -1 )
+	return -1;
+    std::lock_guard<std::mutex> lock { mutex };
+    shards[id].roots.push_back(Root { path, wd, mask });
+    return id;
+}
+
+template <typename Log>
+void ShardedInotify<Log>::exclude(const std::string& root, const std::string& pattern)
+// Give the exclude rule (as Inotify::exclude() does) to every shard, since the root may
+// be added to, or moved by rebalance() to, any of them.
+{
+    for ( Shard& shard: shards )
+	call(shard, [root, pattern](auto& inotify) { inotify.exclude(root, pattern); });
+}
+
+template <typename Log>
+void ShardedInotify<Log>::set_watch_budget(std::size_t limit, double high, double low,
+    float hot)
+// Split the limit of kernel watches evenly over the shards, each of which keeps to its
+// share as Inotify::set_watch_budget() does, or set no limit if 0.
+{
+    const std::size_t share = limit ? std::max<std::size_t>(1, limit / shards.size()) : 0;
+    for ( Shard& shard: shards )
+	call(shard, [share, high, low, hot](auto& inotify) {
+	    inotify.set_watch_budget(share, high, low, hot);
+	});
+}
+
+template <typename Log>
+void ShardedInotify<Log>::rm_watch(const std::string& path)
+// Remove the watch added by add_watch() with the path, and all the watches below it.
+{
+    for ( Shard& shard: shards ) {
+	int wd = -1;
+	{
+	    std::lock_guard<std::mutex> lock { mutex };
+	    for ( auto root = shard.roots.begin() ; root != shard.roots.end() ; ++root )
+		if ( root->path == path ) {
+		    wd = root->wd;
+		    shard.roots.erase(root);
+		    break;
+		}
+	}
+	if ( wd != -1 ) {
+	    call(shard, [wd, path](auto& inotify) {
+		if ( wd == 0 )  // pending
+		    inotify.rm_pending(path);
+		else
+		    inotify.rm_watch(wd, true);
+	    });
+	    return;
+	}
+    }
+}
+
+template <typename Log>
+bool ShardedInotify<Log>::receive(Event& event, int timeout)
+// Receive the earliest event read from all the shards, or return false if timed out or
+// cancelled.
+// The events from each shard come in the order kernel has reported (by their seq), and
+// those from different shards come in the order they were queued (by their arrival
+// numbers), but the events that are still in the kernel queue of a shard or in flight
+// are not waited for.
+// Will rethrow the exception that has stopped a reader, if any.
+{
+    std::unique_lock<std::mutex> lock { mutex };
+    const auto any = [this] {
+	if ( cancelled || error )
+	    return true;
+	for ( const Shard& shard: shards )
+	    if ( !shard.queue.empty() )
+		return true;
+	return false;
+    };
+    if ( timeout < 0 )
+	ready.wait(lock, any);
+    else if ( !ready.wait_for(lock, std::chrono::milliseconds(timeout), any) )
+	return false;  // timed out!
+
+    if ( std::exchange(cancelled, false) )
+	return false;
+    if ( error )
+	std::rethrow_exception(std::exchange(error, nullptr));
+
+    Shard* earliest = nullptr;
+    for ( Shard& shard: shards )
+	if ( !shard.queue.empty() &&
+	    (!earliest || shard.queue.front().first < earliest->queue.front().first) )
+	    earliest = &shard;
+    event = std::move(earliest->queue.front().second);
+    earliest->queue.pop_front();
+    return true;
+}
+
+template <typename Log>
+bool ShardedInotify<Log>::rebalance()
+// Move a root off the shard with the most events since the last rebalance(), to the
+// shard with the fewest, if that makes them closer, and return true if moved.
+// It is meant to be called periodically, so that a hot directory tree ends up in a shard
+// of its own.
+// Only whole roots are moved, so a single root never spreads over shards however hot it
+// is; a large tree is better added as several roots, such as its top subdirectories.
+// The root is added to the new shard before removed from the old one, so some events
+// may be reported twice while moving, but none is missed.
+{
+    std::string path;
+    uint32_t mask = 0;
+    unsigned from, to;
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	from = to = 0;
+	for ( unsigned i = 1 ; i < shards.size() ; ++i ) {
+	    if ( shards[i].events > shards[from].events )
+		from = i;
+	    if ( shards[i].events < shards[to].events )
+		to = i;
+	}
+
+	// Moving a root with n events makes them closer if to + n < from. Of such roots, we
+	// take the hottest, unless it is alone, so that a root too hot to fit anywhere is
+	// left alone in its shard as the others move away.
+	const Root* moving = nullptr;
+	if ( from != to && shards[from].roots.size() > 1 )
+	    for ( const Root& root: shards[from].roots )
+		if ( shards[to].events + root.events < shards[from].events &&
+		    (!moving || root.events > moving->events) )
+		    moving = &root;
+	if ( moving ) {
+	    path = moving->path;
+	    mask = moving->mask;
+	}
+
+	for ( Shard& shard: shards ) {
+	    shard.events = 0;
+	    for ( Root& root: shard.roots )
+		root.events = 0;
+	}
+    }
+    if ( path.empty() )
+	return false;
+
+    const int wd = call(shards[to], [path, mask](auto& inotify) {
+	return inotify.add_watch(path, true, mask);
+    });
+    if ( wd == -1 )
+	return false;
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	shards[to].roots.push_back(Root { path, wd, mask });
+    }
+
+    int old = -1;
+    {
+	std::lock_guard<std::mutex> lock { mutex };
+	for ( auto root = shards[from].roots.begin() ; root != shards[from].roots.end() ;
+	    ++root )
+	    if ( root->path == path ) {
+		old = root->wd;
+		shards[from].roots.erase(root);
+		break;
+	    }
+    }
+    if ( old != -1 )  // unless removed by rm_watch() meanwhile
+	call(shards[from], [old, path](auto& inotify) {
+	    if ( old == 0 )  // pending
+		inotify.rm_pending(path);
+	    else
+		inotify.rm_watch(old, true);
+	});
+    log("Info: %s moved from shard %u to %u", path.c_str(), from, to);
+    return true;
+}
+
+#endif /* SHARDED_HPP */
@@ -1,4 +1,4 @@
-// To compile: g++ [-DDEBUG] -O2 test.cpp -lstdc++fs
+// To compile: g++ [-DDEBUG] -O2 test.cpp -pthread
 
 #include <iostream>
 #include "syslog.hpp"
@@ -13,6 +13,10 @@ int main() {
 	inotify.add_watch("/home/user2/");  // meaning "/home/user2/*/"
 	for (;;) {
 	    const inotify_event* eventp = inotify.read();
+	    if ( eventp->mask & IN_Q_OVERFLOW ) {  // with wd of -1
+		std::cout << "Events overflowed\n";
+		continue;
+	    }
 	    (std::cout << inotify.path(eventp->wd) << ": "
 		).write(eventp->name, eventp->len)
 		<< "\t(0x" << std::hex << eventp->mask << ")\n";